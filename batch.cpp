@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <utility>
+#include <vector>
+#include "arcball_camera.h"
+#include "scene.h"
+#include "stb_image_write.h"
+#include "util.h"
+
+#if ENABLE_OSPRAY
+#include "ospray/render_ospray.h"
+#endif
+#if ENABLE_EMBREE
+#include "embree/render_embree.h"
+#endif
+
+const std::string USAGE = std::string(
+    "Usage: <backend> <obj_file> [options]\n"
+    "Renders the scene without opening a window and writes the final image\n"
+    "Backends:\n"
+#if ENABLE_OSPRAY
+    "\t-ospray    Render with OSPRay\n"
+#endif
+#if ENABLE_EMBREE
+    "\t-embree    Render with Embree\n"
+#endif
+    "Options:\n"
+    "\t-eye <x> <y> <z>       Set the camera position\n"
+    "\t-center <x> <y> <z>    Set the camera focus point\n"
+    "\t-up <x> <y> <z>        Set the camera up vector\n"
+    "\t-fov <fovy>            Specify the camera field of view (in degrees)\n"
+    "\t-camera <n>            If the scene contains multiple cameras, specify which\n"
+    "\t                       should be used. Defaults to the first camera\n"
+    "\t-scene-cache           Load the scene from a binary cache written next to the\n"
+    "\t                       scene file on the first load, skipping parsing it\n"
+    "\t-img <x> <y>           Specify the image dimensions. Defaults to 1280x720\n"
+    "\t-spp <n>               Number of samples per-pixel to render. Defaults to 64\n"
+    "\t-time <seconds>        Stop rendering once this wall-clock budget is used,\n"
+    "\t                       even if fewer than -spp samples were taken\n"
+    "\t-samples-per-call <n>  Number of samples per-pixel to take in each call to the\n"
+    "\t                       renderer. -spp is rounded up to a multiple of n\n"
+    "\t-o <file.png>          Output image file. Defaults to chameleonrt.png\n"
+    "\t-aov-prefix <prefix>   Also write the AOVs supported by the backend to\n"
+    "\t                       <prefix>_<aov>.pfm\n"
+    "\t-max-depth <n>         Maximum number of bounces per path. Defaults to 5\n"
+    "\t-rr-depth <n>          Number of bounces before paths can be terminated by Russian\n"
+    "\t                       roulette. Defaults to no roulette\n")
+#if ENABLE_EMBREE
+    + embree_option_usage()
+#endif
+    + "\n";
+
+// Write the 1 or 3 channel float image to a PFM file, whose rows are stored bottom to top
+void write_pfm(const std::string &file,
+               const int width,
+               const int height,
+               const int channels,
+               const std::vector<float> &data)
+{
+    std::ofstream fout(file.c_str(), std::ios::binary);
+    fout << (channels == 3 ? "PF" : "Pf") << "\n" << width << " " << height << "\n-1.0\n";
+    for (int y = height - 1; y >= 0; --y) {
+        fout.write(reinterpret_cast<const char *>(&data[size_t(y) * width * channels]),
+                   sizeof(float) * width * channels);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    using namespace std::chrono;
+    const std::vector<std::string> args(argv, argv + argc);
+    auto fnd_help = std::find_if(args.begin(), args.end(), [](const std::string &a) {
+        return a == "-h" || a == "--help";
+    });
+
+    if (argc < 3 || fnd_help != args.end()) {
+        std::cout << USAGE;
+        return 1;
+    }
+
+    std::string scene_file;
+    std::string backend;
+#if ENABLE_EMBREE
+    EmbreeOptions embree_options;
+#endif
+    bool got_camera_args = false;
+    glm::vec3 eye(0, 0, 5);
+    glm::vec3 center(0);
+    glm::vec3 up(0, 1, 0);
+    float fov_y = 65.f;
+    size_t camera_id = 0;
+    bool use_scene_cache = false;
+    int width = 1280;
+    int height = 720;
+    size_t spp = 64;
+    size_t samples_per_call = 1;
+    float time_budget = -1.f;
+    std::string image_output = "chameleonrt.png";
+    std::string aov_prefix;
+    PathParams path_params;
+    bool got_path_params = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "-eye") {
+            eye.x = std::stof(args[++i]);
+            eye.y = std::stof(args[++i]);
+            eye.z = std::stof(args[++i]);
+            got_camera_args = true;
+        } else if (args[i] == "-center") {
+            center.x = std::stof(args[++i]);
+            center.y = std::stof(args[++i]);
+            center.z = std::stof(args[++i]);
+            got_camera_args = true;
+        } else if (args[i] == "-up") {
+            up.x = std::stof(args[++i]);
+            up.y = std::stof(args[++i]);
+            up.z = std::stof(args[++i]);
+            got_camera_args = true;
+        } else if (args[i] == "-fov") {
+            fov_y = std::stof(args[++i]);
+            got_camera_args = true;
+        } else if (args[i] == "-camera") {
+            camera_id = std::stol(args[++i]);
+        } else if (args[i] == "-scene-cache") {
+            use_scene_cache = true;
+        } else if (args[i] == "-img") {
+            width = std::stoi(args[++i]);
+            height = std::stoi(args[++i]);
+        } else if (args[i] == "-spp") {
+            spp = std::stoul(args[++i]);
+        } else if (args[i] == "-samples-per-call") {
+            samples_per_call = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "-time") {
+            time_budget = std::stof(args[++i]);
+        } else if (args[i] == "-o") {
+            image_output = args[++i];
+        } else if (args[i] == "-aov-prefix") {
+            aov_prefix = args[++i];
+        } else if (args[i] == "-max-depth") {
+            path_params.max_depth = std::max(std::stoi(args[++i]), 1);
+            got_path_params = true;
+        } else if (args[i] == "-rr-depth") {
+            path_params.roulette_min_depth = std::max(std::stoi(args[++i]), 0);
+            got_path_params = true;
+        }
+#if ENABLE_OSPRAY
+        else if (args[i] == "-ospray") {
+            backend = args[i];
+        }
+#endif
+#if ENABLE_EMBREE
+        else if (args[i] == "-embree") {
+            backend = args[i];
+        } else if (parse_embree_option(embree_options, args, i)) {
+        }
+#endif
+        else {
+            scene_file = args[i];
+            canonicalize_path(scene_file);
+        }
+    }
+
+    std::unique_ptr<RenderBackend> renderer = nullptr;
+#if ENABLE_OSPRAY
+    if (backend == "-ospray") {
+        renderer = std::make_unique<RenderOSPRay>();
+    }
+#endif
+#if ENABLE_EMBREE
+    if (backend == "-embree") {
+        renderer = std::make_unique<RenderEmbree>(embree_options);
+    }
+#endif
+    if (!renderer) {
+        std::cout << "Error: No renderer backend or invalid backend name specified\n" << USAGE;
+        return 1;
+    }
+    if (scene_file.empty()) {
+        std::cout << "Error: No model file specified\n" << USAGE;
+        return 1;
+    }
+    if (spp == 0) {
+        std::cout << "Error: -spp must be at least 1\n";
+        return 1;
+    }
+    // Some backends restart accumulation if the number of samples per-call changes, so
+    // only render full calls
+    spp = ((spp + samples_per_call - 1) / samples_per_call) * samples_per_call;
+
+    if (got_path_params) {
+        renderer->set_path_params(path_params);
+    }
+    renderer->initialize(width, height);
+
+    {
+        auto start = high_resolution_clock::now();
+        Scene scene(scene_file, use_scene_cache);
+        auto end = high_resolution_clock::now();
+
+        std::cout << "Scene '" << scene_file << "' loaded in "
+                  << duration_cast<milliseconds>(end - start).count() << "ms:\n"
+                  << "# Unique Triangles: " << pretty_print_count(scene.unique_tris()) << "\n"
+                  << "# Total Triangles: " << pretty_print_count(scene.total_tris()) << "\n"
+                  << "# Geometries: " << scene.num_geometries() << "\n"
+                  << "# Meshes: " << scene.meshes.size() << "\n"
+                  << "# Instances: " << scene.instances.size() << "\n"
+                  << "# Materials: " << scene.materials.size() << "\n"
+                  << "# Textures: " << scene.textures.size() << "\n"
+                  << "# Lights: " << scene.lights.size() << "\n"
+                  << "# Cameras: " << scene.cameras.size() << "\n";
+
+        start = high_resolution_clock::now();
+        renderer->set_scene(scene);
+        end = high_resolution_clock::now();
+        std::cout << "Scene set in " << duration_cast<milliseconds>(end - start).count()
+                  << "ms\n";
+
+        if (!got_camera_args && !scene.cameras.empty()) {
+            eye = scene.cameras[camera_id].position;
+            center = scene.cameras[camera_id].center;
+            up = scene.cameras[camera_id].up;
+            fov_y = scene.cameras[camera_id].fov_y;
+        }
+    }
+
+    const ArcballCamera camera(eye, center, up);
+
+    std::cout << "Rendering " << width << "x" << height << " with " << renderer->name()
+              << " on " << get_cpu_brand() << "\n";
+
+    // The CPU backends always write the framebuffer, but GPU-style backends only need to
+    // read it back for the frame we're going to save. With a time budget we don't know
+    // which frame is the last one, so read back each frame.
+    const bool always_readback = time_budget > 0.f;
+    size_t frame_id = 0;
+    size_t num_calls = 0;
+    float render_time = 0.f;
+    float rays_per_second = 0.f;
+    float lane_occupancy = 0.f;
+    const auto start = high_resolution_clock::now();
+    while (frame_id < spp) {
+        const bool readback = always_readback || frame_id + samples_per_call == spp;
+        RenderStats stats = renderer->render_samples(camera.eye(),
+                                                     camera.dir(),
+                                                     camera.up(),
+                                                     fov_y,
+                                                     frame_id == 0,
+                                                     readback,
+                                                     samples_per_call);
+        render_time += stats.render_time;
+        rays_per_second += stats.rays_per_second;
+        if (stats.lane_occupancy >= 0.f) {
+            lane_occupancy += stats.lane_occupancy;
+        }
+        frame_id += samples_per_call;
+        ++num_calls;
+
+        const float elapsed =
+            duration_cast<milliseconds>(high_resolution_clock::now() - start).count() *
+            1.0e-3f;
+        if (time_budget > 0.f && elapsed >= time_budget) {
+            break;
+        }
+        if (stats.converged) {
+            std::cout << "Image converged after " << frame_id << " samples per-pixel\n";
+            break;
+        }
+    }
+    const float total_time =
+        duration_cast<milliseconds>(high_resolution_clock::now() - start).count() * 1.0e-3f;
+
+    std::cout << "Rendered " << frame_id << " samples per-pixel in " << total_time << "s\n"
+              << "Render Time: " << render_time / frame_id << " ms/sample\n";
+    if (rays_per_second > 0.f) {
+        std::cout << "Rays per-second: " << pretty_print_count(rays_per_second / num_calls)
+                  << "Ray/s\n";
+    }
+    if (lane_occupancy > 0.f) {
+        std::cout << "SIMD lane occupancy: " << 100.f * lane_occupancy / num_calls << "%\n";
+    }
+
+    stbi_write_png(
+        image_output.c_str(), width, height, 4, renderer->img.data(), 4 * width);
+    std::cout << "Image saved to " << image_output << "\n";
+
+    if (!aov_prefix.empty()) {
+        const std::vector<std::pair<AOV, std::string>> float_aovs = {
+            {AOV::DEPTH, "depth"}, {AOV::NORMAL, "normal"}, {AOV::ALBEDO, "albedo"}};
+        const std::vector<std::pair<AOV, std::string>> uint_aovs = {
+            {AOV::INSTANCE_ID, "instance_id"},
+            {AOV::MATERIAL_ID, "material_id"},
+            {AOV::SAMPLE_COUNT, "sample_count"}};
+
+        std::vector<float> data;
+        for (const auto &aov : float_aovs) {
+            if (renderer->read_aov(aov.first, data)) {
+                const std::string file = aov_prefix + "_" + aov.second + ".pfm";
+                write_pfm(file, width, height, data.size() / (width * height), data);
+                std::cout << "AOV saved to " << file << "\n";
+            }
+        }
+        // PFM only stores floats, so write the IDs as floats with -1 for invalid IDs
+        std::vector<uint32_t> ids;
+        for (const auto &aov : uint_aovs) {
+            if (renderer->read_aov(aov.first, ids)) {
+                data.resize(ids.size());
+                std::transform(ids.begin(), ids.end(), data.begin(), [](const uint32_t id) {
+                    return id == uint32_t(-1) ? -1.f : static_cast<float>(id);
+                });
+                const std::string file = aov_prefix + "_" + aov.second + ".pfm";
+                write_pfm(file, width, height, 1, data);
+                std::cout << "AOV saved to " << file << "\n";
+            }
+        }
+    }
+
+    return 0;
+}
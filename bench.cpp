@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "arcball_camera.h"
+#include "json.hpp"
+#include "scene.h"
+#include "util.h"
+#include <glm/ext.hpp>
+
+#if ENABLE_OSPRAY
+#include "ospray/render_ospray.h"
+#endif
+#if ENABLE_EMBREE
+#include "embree/render_embree.h"
+#endif
+
+using json = nlohmann::json;
+
+const std::string USAGE = std::string(
+    "Usage: [options] <scene_file> [<scene_file> ...]\n"
+    "Renders each scene with each backend, resolution and sample count combination\n"
+    "and writes the timing results as JSON\n"
+    "Options:\n"
+    "\t-backends <b,...>      Comma separated list of backends to run. Defaults to all\n"
+    "\t                       compiled in backends, available:"
+#if ENABLE_OSPRAY
+    " ospray"
+#endif
+#if ENABLE_EMBREE
+    " embree"
+#endif
+    "\n"
+    "\t-img <WxH,...>         Comma separated list of image sizes. Defaults to 1280x720\n"
+    "\t-spp <n,...>           Comma separated list of samples per-pixel (frames) to time.\n"
+    "\t                       Defaults to 64\n"
+    "\t-samples-per-call <n>  Number of samples per-pixel taken by each render call, the\n"
+    "\t                       sample counts are rounded up to a multiple of n. Defaults to 1\n"
+    "\t-warmup <n>            Number of untimed warm up frames per run. Defaults to 4\n"
+    "\t-reps <n>              Number of times to repeat each run. Defaults to 3\n"
+    "\t-camera <n>            If the scene contains multiple cameras, specify which\n"
+    "\t                       should be used. Defaults to the first camera\n"
+    "\t-scene-cache           Load the scene from a binary cache written next to the\n"
+    "\t                       scene file on the first load, skipping parsing it\n"
+    "\t-o <file.json>         Output file. Defaults to chameleonrt_bench.json\n"
+    "\t-max-depth <n>         Maximum number of bounces per path. Defaults to 5\n"
+    "\t-rr-depth <n>          Number of bounces before paths can be terminated by Russian\n"
+    "\t                       roulette. Defaults to no roulette\n"
+    "\t-animate <frames>      Also play a procedural vertex animation of the meshes for the\n"
+    "\t                       number of frames and time refitting vs. rebuilding the BVHs\n")
+#if ENABLE_EMBREE
+    + embree_option_usage()
+    + "\t-bvh-qualities <q,...> Comma separated list of BVH build qualities to run each\n"
+      "\t                       scene with, to compare build time against rays per-second\n"
+#endif
+    + "\n";
+
+std::vector<std::string> split_list(const std::string &str)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+#if ENABLE_EMBREE
+EmbreeOptions embree_options;
+#endif
+
+std::unique_ptr<RenderBackend> create_renderer(const std::string &backend)
+{
+#if ENABLE_OSPRAY
+    if (backend == "ospray") {
+        return std::make_unique<RenderOSPRay>();
+    }
+#endif
+#if ENABLE_EMBREE
+    if (backend == "embree") {
+        return std::make_unique<RenderEmbree>(embree_options);
+    }
+#endif
+    throw std::runtime_error("Unsupported or not compiled in backend " + backend);
+}
+
+// Compute the p-th percentile of the sorted values using the nearest rank
+float percentile(const std::vector<float> &sorted, const float p)
+{
+    const size_t rank = std::ceil(p / 100.f * sorted.size());
+    return sorted[std::min(std::max(rank, size_t(1)), sorted.size()) - 1];
+}
+
+json summarize(std::vector<float> values)
+{
+    json stats;
+    if (values.empty()) {
+        return stats;
+    }
+    std::sort(values.begin(), values.end());
+    stats["mean"] = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    stats["min"] = values.front();
+    stats["max"] = values.back();
+    stats["p50"] = percentile(values, 50.f);
+    stats["p95"] = percentile(values, 95.f);
+    stats["p99"] = percentile(values, 99.f);
+    return stats;
+}
+
+/* Displace the vertices of each mesh in the rest pose by a wave traveling along the
+ * mesh's bounding box, with an amplitude of 1% of its diagonal, at time t in [0, 1).
+ * The normals are left in the rest pose
+ */
+void deform_meshes(Scene &animated, const Scene &rest, const float t)
+{
+    for (size_t m = 0; m < rest.meshes.size(); ++m) {
+        for (size_t g = 0; g < rest.meshes[m].geometries.size(); ++g) {
+            const auto &rest_geom = rest.meshes[m].geometries[g];
+            auto &geom = animated.meshes[m].geometries[g];
+            glm::vec3 lower(std::numeric_limits<float>::infinity());
+            glm::vec3 upper(-std::numeric_limits<float>::infinity());
+            for (const auto &v : rest_geom.vertices) {
+                lower = glm::min(lower, v);
+                upper = glm::max(upper, v);
+            }
+            const float diagonal = std::max(glm::length(upper - lower), 1e-6f);
+            const glm::vec3 axis = (upper - lower) / diagonal;
+            for (size_t i = 0; i < rest_geom.vertices.size(); ++i) {
+                const glm::vec3 &v = rest_geom.vertices[i];
+                const glm::vec3 n =
+                    rest_geom.normals.empty() ? glm::vec3(0, 1, 0) : rest_geom.normals[i];
+                const float phase = 4.f * glm::dot(v - lower, axis) / diagonal - t;
+                geom.vertices[i] =
+                    v + 0.01f * diagonal * std::sin(2.f * glm::pi<float>() * phase) * n;
+            }
+        }
+    }
+}
+
+/* Play the procedural animation for the number of frames, taking samples_per_call
+ * samples each frame, first updating the meshes through update_meshes (if the backend
+ * supports it) and then by calling set_scene each frame
+ */
+json run_animation(RenderBackend &renderer,
+                   const Scene &scene,
+                   const ArcballCamera &camera,
+                   const float fov_y,
+                   const size_t frames,
+                   const size_t samples_per_call)
+{
+    using namespace std::chrono;
+    Scene animated = scene;
+    std::vector<uint32_t> mesh_ids(scene.meshes.size(), 0);
+    std::iota(mesh_ids.begin(), mesh_ids.end(), 0);
+
+    std::vector<float> refit_times, refit_render_times;
+    std::vector<float> rebuild_times, rebuild_render_times;
+    for (const bool refit : {true, false}) {
+        for (size_t f = 0; f < frames; ++f) {
+            deform_meshes(animated, scene, static_cast<float>(f) / frames);
+
+            auto start = high_resolution_clock::now();
+            if (refit) {
+                if (!renderer.update_meshes(mesh_ids, animated)) {
+                    break;
+                }
+            } else {
+                renderer.set_scene(animated);
+            }
+            auto end = high_resolution_clock::now();
+            const float update_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+
+            const RenderStats stats = renderer.render_samples(camera.eye(),
+                                                              camera.dir(),
+                                                              camera.up(),
+                                                              fov_y,
+                                                              true,
+                                                              f + 1 == frames,
+                                                              samples_per_call);
+            if (refit) {
+                refit_times.push_back(update_time);
+                refit_render_times.push_back(stats.render_time);
+            } else {
+                rebuild_times.push_back(update_time);
+                rebuild_render_times.push_back(stats.render_time);
+            }
+        }
+    }
+    // Restore the rest pose for any following runs
+    renderer.set_scene(scene);
+
+    json anim;
+    anim["frames"] = frames;
+    anim["refit_ms"] = summarize(refit_times);
+    anim["refit_render_time_ms"] = summarize(refit_render_times);
+    anim["rebuild_ms"] = summarize(rebuild_times);
+    anim["rebuild_render_time_ms"] = summarize(rebuild_render_times);
+    return anim;
+}
+
+int main(int argc, const char **argv)
+{
+    using namespace std::chrono;
+    const std::vector<std::string> args(argv, argv + argc);
+    auto fnd_help = std::find_if(args.begin(), args.end(), [](const std::string &a) {
+        return a == "-h" || a == "--help";
+    });
+
+    if (argc < 2 || fnd_help != args.end()) {
+        std::cout << USAGE;
+        return 1;
+    }
+
+    std::vector<std::string> scene_files;
+    std::vector<std::string> backends = {
+#if ENABLE_OSPRAY
+        "ospray",
+#endif
+#if ENABLE_EMBREE
+        "embree",
+#endif
+    };
+    std::vector<glm::uvec2> resolutions = {glm::uvec2(1280, 720)};
+    std::vector<size_t> sample_counts = {64};
+    size_t samples_per_call = 1;
+    size_t warmup_frames = 4;
+    size_t repetitions = 3;
+    size_t camera_id = 0;
+    bool use_scene_cache = false;
+    size_t animation_frames = 0;
+    std::vector<std::string> bvh_qualities;
+    std::string output = "chameleonrt_bench.json";
+    PathParams path_params;
+    bool got_path_params = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "-backends") {
+            backends = split_list(args[++i]);
+        } else if (args[i] == "-img") {
+            resolutions.clear();
+            for (const auto &r : split_list(args[++i])) {
+                const size_t x = r.find('x');
+                if (x == std::string::npos) {
+                    std::cout << "Error: Invalid image size '" << r << "', expected WxH\n";
+                    return 1;
+                }
+                resolutions.emplace_back(std::stoul(r.substr(0, x)),
+                                         std::stoul(r.substr(x + 1)));
+            }
+        } else if (args[i] == "-spp") {
+            sample_counts.clear();
+            for (const auto &s : split_list(args[++i])) {
+                sample_counts.push_back(std::stoul(s));
+            }
+        } else if (args[i] == "-samples-per-call") {
+            samples_per_call = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "-warmup") {
+            warmup_frames = std::stoul(args[++i]);
+        } else if (args[i] == "-reps") {
+            repetitions = std::stoul(args[++i]);
+        } else if (args[i] == "-camera") {
+            camera_id = std::stol(args[++i]);
+        } else if (args[i] == "-scene-cache") {
+            use_scene_cache = true;
+        } else if (args[i] == "-animate") {
+            animation_frames = std::stoul(args[++i]);
+        } else if (args[i] == "-o") {
+            output = args[++i];
+        } else if (args[i] == "-max-depth") {
+            path_params.max_depth = std::max(std::stoi(args[++i]), 1);
+            got_path_params = true;
+        } else if (args[i] == "-rr-depth") {
+            path_params.roulette_min_depth = std::max(std::stoi(args[++i]), 0);
+            got_path_params = true;
+        }
+#if ENABLE_EMBREE
+        else if (args[i] == "-bvh-qualities") {
+            bvh_qualities = split_list(args[++i]);
+        } else if (parse_embree_option(embree_options, args, i)) {
+        }
+#endif
+        else {
+            std::string scene_file = args[i];
+            canonicalize_path(scene_file);
+            scene_files.push_back(scene_file);
+        }
+    }
+    if (scene_files.empty()) {
+        std::cout << "Error: No scene files specified\n" << USAGE;
+        return 1;
+    }
+    if (backends.empty() || resolutions.empty() || sample_counts.empty()) {
+        std::cout << "Error: Empty list of backends, image sizes or sample counts\n";
+        return 1;
+    }
+    if (repetitions == 0 || std::find(sample_counts.begin(), sample_counts.end(), 0) !=
+                                sample_counts.end()) {
+        std::cout << "Error: -reps and -spp must be at least 1\n";
+        return 1;
+    }
+
+    json results;
+    results["cpu"] = get_cpu_brand();
+    results["warmup_frames"] = warmup_frames;
+    results["repetitions"] = repetitions;
+    results["runs"] = json::array();
+    results["animations"] = json::array();
+
+    for (const auto &scene_file : scene_files) {
+        auto start = high_resolution_clock::now();
+        const Scene scene(scene_file, use_scene_cache);
+        auto end = high_resolution_clock::now();
+        const float scene_load_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+
+        glm::vec3 eye(0, 0, 5);
+        glm::vec3 center(0);
+        glm::vec3 up(0, 1, 0);
+        float fov_y = 65.f;
+        if (!scene.cameras.empty()) {
+            eye = scene.cameras[camera_id].position;
+            center = scene.cameras[camera_id].center;
+            up = scene.cameras[camera_id].up;
+            fov_y = scene.cameras[camera_id].fov_y;
+        }
+        const ArcballCamera camera(eye, center, up);
+
+        // Each backend to run, along with the Embree BVH quality to use if comparing them
+        std::vector<std::pair<std::string, std::string>> configs;
+        for (const auto &backend : backends) {
+            if (backend == "embree" && !bvh_qualities.empty()) {
+                for (const auto &q : bvh_qualities) {
+                    configs.emplace_back(backend, q);
+                }
+            } else {
+                configs.emplace_back(backend, "");
+            }
+        }
+
+        for (const auto &config : configs) {
+            const std::string &backend = config.first;
+#if ENABLE_EMBREE
+            // The renderer copies the options, so the -bvh-quality setting is restored for
+            // the next config once it's created
+            const RTCBuildQuality bvh_quality = embree_options.bvh.quality;
+            if (!config.second.empty()) {
+                embree_options.bvh.quality = embree::parse_bvh_quality(config.second);
+            }
+#endif
+            std::unique_ptr<RenderBackend> renderer = create_renderer(backend);
+#if ENABLE_EMBREE
+            embree_options.bvh.quality = bvh_quality;
+#endif
+            if (got_path_params) {
+                renderer->set_path_params(path_params);
+            }
+            renderer->initialize(resolutions[0].x, resolutions[0].y);
+
+            start = high_resolution_clock::now();
+            renderer->set_scene(scene);
+            end = high_resolution_clock::now();
+            const float set_scene_time =
+                duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+            // Copied since the animation runs below call set_scene again
+            const auto set_scene_stages = renderer->set_scene_stage_times;
+
+            for (const auto &res : resolutions) {
+                renderer->initialize(res.x, res.y);
+                for (const auto &spp : sample_counts) {
+                    std::cout << scene_file << ": " << renderer->name() << " at " << res.x
+                              << "x" << res.y << ", " << spp << "spp\n";
+
+                    std::vector<float> render_times;
+                    std::vector<float> rays_per_second;
+                    std::vector<float> lane_occupancy;
+                    // The render time is recorded per-sample, to compare runs with
+                    // different numbers of samples per-call
+                    const size_t num_calls = (spp + samples_per_call - 1) / samples_per_call;
+                    for (size_t r = 0; r < repetitions; ++r) {
+                        const size_t total_calls = warmup_frames + num_calls;
+                        for (size_t f = 0; f < total_calls; ++f) {
+                            const RenderStats stats =
+                                renderer->render_samples(camera.eye(),
+                                                         camera.dir(),
+                                                         camera.up(),
+                                                         fov_y,
+                                                         f == 0,
+                                                         f + 1 == total_calls,
+                                                         samples_per_call);
+                            if (f < warmup_frames) {
+                                continue;
+                            }
+                            render_times.push_back(stats.render_time / samples_per_call);
+                            if (stats.rays_per_second > 0.f) {
+                                rays_per_second.push_back(stats.rays_per_second);
+                            }
+                            if (stats.lane_occupancy >= 0.f) {
+                                lane_occupancy.push_back(stats.lane_occupancy);
+                            }
+                        }
+                    }
+
+                    json run;
+                    run["scene"] = scene_file;
+                    run["backend"] = renderer->name();
+                    if (!config.second.empty()) {
+                        run["bvh_quality"] = config.second;
+                    }
+                    run["width"] = res.x;
+                    run["height"] = res.y;
+                    run["spp"] = num_calls * samples_per_call;
+                    run["samples_per_call"] = samples_per_call;
+                    if (got_path_params) {
+                        run["max_depth"] = path_params.max_depth;
+                        run["roulette_min_depth"] = path_params.roulette_min_depth;
+                    }
+                    run["unique_tris"] = scene.unique_tris();
+                    run["total_tris"] = scene.total_tris();
+                    run["scene_load_ms"] = scene_load_time;
+                    run["set_scene_ms"] = set_scene_time;
+                    for (const auto &stage : set_scene_stages) {
+                        run["set_scene_stages_ms"][stage.first] = stage.second;
+                    }
+                    run["render_time_ms"] = summarize(render_times);
+                    run["rays_per_second"] = summarize(rays_per_second);
+                    run["lane_occupancy"] = summarize(lane_occupancy);
+                    // Note: this is the peak for the process so far, not just this run
+                    run["peak_memory_bytes"] = get_peak_memory_usage();
+                    results["runs"].push_back(run);
+
+                    std::cout << "\tmean: " << run["render_time_ms"]["mean"].get<float>()
+                              << "ms, p95: " << run["render_time_ms"]["p95"].get<float>()
+                              << "ms\n";
+                }
+            }
+
+            if (animation_frames > 0) {
+                std::cout << scene_file << ": " << renderer->name() << " animating "
+                          << animation_frames << " frames\n";
+                json anim = run_animation(
+                    *renderer, scene, camera, fov_y, animation_frames, samples_per_call);
+                anim["scene"] = scene_file;
+                anim["backend"] = renderer->name();
+                if (!config.second.empty()) {
+                    anim["bvh_quality"] = config.second;
+                }
+                anim["width"] = resolutions.back().x;
+                anim["height"] = resolutions.back().y;
+                std::cout << "\t";
+                if (!anim["refit_ms"].empty()) {
+                    std::cout << "refit mean: " << anim["refit_ms"]["mean"].get<float>()
+                              << "ms, ";
+                }
+                std::cout << "rebuild mean: " << anim["rebuild_ms"]["mean"].get<float>()
+                          << "ms\n";
+                results["animations"].push_back(anim);
+            }
+        }
+    }
+
+    std::ofstream fout(output.c_str());
+    fout << results.dump(4) << "\n";
+    std::cout << "Results written to " << output << "\n";
+
+    return 0;
+}
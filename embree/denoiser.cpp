@@ -0,0 +1,88 @@
+#include "denoiser.h"
+#include <tbb/parallel_for.h>
+#include "render_embree_ispc.h"
+
+namespace embree {
+
+void Denoiser::initialize(const glm::uvec2 &dims)
+{
+    fb_dims = dims;
+    const size_t num_pixels = size_t(fb_dims.x) * fb_dims.y;
+    albedo.resize(num_pixels * 3, 1.f);
+    normal.resize(num_pixels * 3, 0.f);
+    depth.resize(num_pixels, 0.f);
+    for (auto &c : color) {
+        c.resize(num_pixels * 3, 0.f);
+    }
+}
+
+FeatureBuffers Denoiser::feature_buffers()
+{
+    FeatureBuffers features;
+    features.albedo = albedo.data();
+    features.normal = normal.data();
+    features.depth = depth.data();
+    return features;
+}
+
+void Denoiser::denoise(const std::vector<std::vector<float>> &tiles,
+                       const glm::uvec2 &tile_size,
+                       uint8_t *fb)
+{
+    const FeatureBuffers features = feature_buffers();
+    const glm::uvec2 ntiles(fb_dims.x / tile_size.x + (fb_dims.x % tile_size.x != 0 ? 1 : 0),
+                            fb_dims.y / tile_size.y + (fb_dims.y % tile_size.y != 0 ? 1 : 0));
+
+    auto for_each_tile = [&](const auto &fn) {
+        tbb::parallel_for(size_t(0), tiles.size(), [&](size_t tile_id) {
+            const glm::uvec2 tile = glm::uvec2(tile_id % ntiles.x, tile_id / ntiles.x);
+            const glm::uvec2 tile_pos = tile * tile_size;
+            const glm::uvec2 tile_end = glm::min(tile_pos + tile_size, fb_dims);
+            fn(tile_id, tile_pos, tile_end - tile_pos);
+        });
+    };
+
+    for_each_tile([&](size_t tile_id, const glm::uvec2 &pos, const glm::uvec2 &dims) {
+        ispc::denoise_demodulate(pos.x,
+                                 pos.y,
+                                 dims.x,
+                                 dims.y,
+                                 fb_dims.x,
+                                 tiles[tile_id].data(),
+                                 &features,
+                                 color[0].data());
+    });
+
+    // Each iteration must finish before the next reads its output, since the filter
+    // taps reach into the neighboring tiles
+    for (uint32_t i = 0; i < iterations; ++i) {
+        const std::vector<float> &in = color[i % 2];
+        std::vector<float> &out = color[(i + 1) % 2];
+        for_each_tile([&](size_t, const glm::uvec2 &pos, const glm::uvec2 &dims) {
+            ispc::atrous_filter(pos.x,
+                                pos.y,
+                                dims.x,
+                                dims.y,
+                                fb_dims.x,
+                                fb_dims.y,
+                                1 << i,
+                                color_phi / (1 << i),
+                                &features,
+                                in.data(),
+                                out.data());
+        });
+    }
+
+    for_each_tile([&](size_t, const glm::uvec2 &pos, const glm::uvec2 &dims) {
+        ispc::denoise_to_uint8(pos.x,
+                               pos.y,
+                               dims.x,
+                               dims.y,
+                               fb_dims.x,
+                               &features,
+                               color[iterations % 2].data(),
+                               fb);
+    });
+}
+
+}
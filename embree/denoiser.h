@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include "embree_utils.h"
+#include <glm/glm.hpp>
+
+namespace embree {
+
+/* An edge-avoiding a-trous wavelet denoiser run on the accumulated image. The filter is
+ * guided by the albedo, normal and depth of the first hit in each pixel, and filters the
+ * illumination with the albedo divided out to preserve texture detail
+ */
+struct Denoiser {
+    glm::uvec2 fb_dims = glm::uvec2(0);
+    uint32_t iterations = 5;
+    // How much the color weight tolerates differences in color, halved each iteration
+    float color_phi = 1.f;
+
+    std::vector<float> albedo, normal, depth;
+    std::vector<float> color[2];
+
+    void initialize(const glm::uvec2 &fb_dims);
+
+    FeatureBuffers feature_buffers();
+
+    /* Denoise the accumulated image in the tiles and write it to the RGBA8 framebuffer.
+     * The tiles are indexed in scanline order, each filter iteration runs in parallel
+     * over the tiles
+     */
+    void denoise(const std::vector<std::vector<float>> &tiles,
+                 const glm::uvec2 &tile_size,
+                 uint8_t *fb);
+};
+
+}
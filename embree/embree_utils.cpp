@@ -1,49 +1,187 @@
 #include "embree_utils.h"
 #include <algorithm>
 #include <limits>
+#include <stdexcept>
+#include <unordered_map>
 #include <glm/ext.hpp>
 
 namespace embree {
 
+namespace {
+
+/* Pair adjacent triangles whose normals are within min_cos_angle of each other into quads.
+ * The indices of paired triangles are rotated so that the quad's first triangle (v0, v1, v3)
+ * and second triangle (v2, v3, v1) have the same vertex order as the triangles, which lets
+ * the quad hit be mapped back to the triangle. Unpaired triangles are stored as degenerate
+ * quads repeating their last vertex
+ */
+void pair_triangles(const MappedArray<glm::vec3> &verts,
+                    MappedArray<glm::uvec3> &indices,
+                    std::vector<glm::uvec4> &quads,
+                    std::vector<glm::uvec2> &quad_tris,
+                    const float min_cos_angle = 0.99f)
+{
+    const auto edge_key = [](const uint32_t a, const uint32_t b) {
+        return (uint64_t(a) << 32) | b;
+    };
+
+    std::vector<glm::vec3> normals(indices.size(), glm::vec3(0.f));
+    std::unordered_map<uint64_t, uint32_t> edges;
+    edges.reserve(indices.size() * 3);
+    for (uint32_t t = 0; t < indices.size(); ++t) {
+        const glm::uvec3 &idx = indices[t];
+        const glm::vec3 n =
+            glm::cross(verts[idx.y] - verts[idx.x], verts[idx.z] - verts[idx.x]);
+        if (glm::length(n) > 0.f) {
+            normals[t] = glm::normalize(n);
+        }
+        for (int e = 0; e < 3; ++e) {
+            edges[edge_key(idx[e], idx[(e + 1) % 3])] = t;
+        }
+    }
+
+    std::vector<bool> paired(indices.size(), false);
+    for (uint32_t t = 0; t < indices.size(); ++t) {
+        if (paired[t]) {
+            continue;
+        }
+        glm::uvec3 &a = indices[t];
+
+        // Find the most coplanar unpaired neighbor sharing an edge with matching winding
+        int best_edge = -1;
+        uint32_t best_neighbor = t;
+        float best_cos_angle = min_cos_angle;
+        for (int e = 0; e < 3; ++e) {
+            auto fnd = edges.find(edge_key(a[(e + 1) % 3], a[e]));
+            if (fnd == edges.end() || fnd->second == t || paired[fnd->second]) {
+                continue;
+            }
+            const float cos_angle = glm::dot(normals[t], normals[fnd->second]);
+            if (cos_angle >= best_cos_angle) {
+                best_edge = e;
+                best_neighbor = fnd->second;
+                best_cos_angle = cos_angle;
+            }
+        }
+
+        if (best_edge < 0) {
+            quads.emplace_back(a.x, a.y, a.z, a.z);
+            quad_tris.emplace_back(t, t);
+            continue;
+        }
+
+        // Rotate the triangle so the shared edge is (a.y, a.z), and the neighbor so it's
+        // (b.z, b.y), making the neighbor's other vertex b.x
+        a = glm::uvec3(a[(best_edge + 2) % 3], a[best_edge], a[(best_edge + 1) % 3]);
+        glm::uvec3 &b = indices[best_neighbor];
+        int f = 0;
+        while (b[f] != a.z) {
+            ++f;
+        }
+        b = glm::uvec3(b[(f + 2) % 3], b[f], b[(f + 1) % 3]);
+
+        quads.emplace_back(a.x, a.y, b.x, a.z);
+        quad_tris.emplace_back(t, best_neighbor);
+        paired[t] = true;
+        paired[best_neighbor] = true;
+    }
+}
+
+}
+
+RTCBuildQuality parse_bvh_quality(const std::string &name)
+{
+    if (name == "low") {
+        return RTC_BUILD_QUALITY_LOW;
+    }
+    if (name == "medium") {
+        return RTC_BUILD_QUALITY_MEDIUM;
+    }
+    if (name == "high") {
+        return RTC_BUILD_QUALITY_HIGH;
+    }
+    throw std::runtime_error("Invalid BVH quality " + name + ", must be low, medium or high");
+}
+
 Geometry::Geometry(RTCDevice &device,
-                   const std::vector<glm::vec3> &verts,
-                   const std::vector<glm::uvec3> &indices,
-                   const std::vector<glm::vec3> &normals,
-                   const std::vector<glm::vec2> &uvs)
+                   const MappedArray<glm::vec3> &verts,
+                   const MappedArray<glm::uvec3> &indices,
+                   const MappedArray<glm::vec3> &normals,
+                   const MappedArray<glm::vec2> &uvs,
+                   const BVHBuildOptions &build_options)
     : index_buf(indices),
       normal_buf(normals),
       uv_buf(uvs),
-      geom(rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE))
-{
-    vertex_buf.reserve(verts.size());
-    std::transform(
-        verts.begin(), verts.end(), std::back_inserter(vertex_buf), [](const glm::vec3 &v) {
-            return glm::vec4(v, 0.f);
-        });
-
-    vbuf =
-        rtcNewSharedBuffer(device, vertex_buf.data(), vertex_buf.size() * sizeof(glm::vec4));
-    ibuf = rtcNewSharedBuffer(device, index_buf.data(), index_buf.size() * sizeof(glm::uvec3));
-
-    rtcSetGeometryBuffer(geom,
-                         RTC_BUFFER_TYPE_VERTEX,
-                         0,
-                         RTC_FORMAT_FLOAT3,
-                         vbuf,
-                         0,
-                         sizeof(glm::vec4),
-                         vertex_buf.size());
-    rtcSetGeometryBuffer(geom,
-                         RTC_BUFFER_TYPE_INDEX,
-                         0,
-                         RTC_FORMAT_UINT3,
-                         ibuf,
-                         0,
-                         sizeof(glm::uvec3),
-                         index_buf.size());
+      geom(rtcNewGeometry(device,
+                          build_options.quads ? RTC_GEOMETRY_TYPE_QUAD
+                                              : RTC_GEOMETRY_TYPE_TRIANGLE))
+{
+    if (verts.is_mapped()) {
+        mapped_vertices = verts;
+        // Embree only reads from the buffer, it's just not const in the API
+        vbuf = rtcNewSharedBuffer(device,
+                                  const_cast<glm::vec3 *>(mapped_vertices.data()),
+                                  mapped_vertices.size() * sizeof(glm::vec3));
+        rtcSetGeometryBuffer(geom,
+                             RTC_BUFFER_TYPE_VERTEX,
+                             0,
+                             RTC_FORMAT_FLOAT3,
+                             vbuf,
+                             0,
+                             sizeof(glm::vec3),
+                             mapped_vertices.size());
+    } else {
+        vertex_buf.reserve(verts.size());
+        std::transform(verts.begin(),
+                       verts.end(),
+                       std::back_inserter(vertex_buf),
+                       [](const glm::vec3 &v) { return glm::vec4(v, 0.f); });
+        vbuf = rtcNewSharedBuffer(
+            device, vertex_buf.data(), vertex_buf.size() * sizeof(glm::vec4));
+        rtcSetGeometryBuffer(geom,
+                             RTC_BUFFER_TYPE_VERTEX,
+                             0,
+                             RTC_FORMAT_FLOAT3,
+                             vbuf,
+                             0,
+                             sizeof(glm::vec4),
+                             vertex_buf.size());
+    }
+
+    if (build_options.quads) {
+        pair_triangles(verts, index_buf, quad_buf, quad_tris);
+        ibuf =
+            rtcNewSharedBuffer(device, quad_buf.data(), quad_buf.size() * sizeof(glm::uvec4));
+    } else {
+        const MappedArray<glm::uvec3> &shared_indices = index_buf;
+        ibuf = rtcNewSharedBuffer(device,
+                                  const_cast<glm::uvec3 *>(shared_indices.data()),
+                                  shared_indices.size() * sizeof(glm::uvec3));
+    }
+
+    if (build_options.quads) {
+        rtcSetGeometryBuffer(geom,
+                             RTC_BUFFER_TYPE_INDEX,
+                             0,
+                             RTC_FORMAT_UINT4,
+                             ibuf,
+                             0,
+                             sizeof(glm::uvec4),
+                             quad_buf.size());
+    } else {
+        rtcSetGeometryBuffer(geom,
+                             RTC_BUFFER_TYPE_INDEX,
+                             0,
+                             RTC_FORMAT_UINT3,
+                             ibuf,
+                             0,
+                             sizeof(glm::uvec3),
+                             index_buf.size());
+    }
 
     rtcUpdateGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0);
     rtcUpdateGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0);
+    rtcSetGeometryBuildQuality(geom, build_options.quality);
     rtcCommitGeometry(geom);
 }
 
@@ -51,14 +189,57 @@ Geometry::~Geometry()
 {
     if (geom) {
         rtcReleaseGeometry(geom);
-        rtcReleaseBuffer(vbuf);
+        if (vbuf) {
+            rtcReleaseBuffer(vbuf);
+        }
         rtcReleaseBuffer(ibuf);
     }
 }
 
-ISPCGeometry::ISPCGeometry(const Geometry &geom)
-    : vertex_buf(geom.vertex_buf.data()), index_buf(geom.index_buf.data())
+size_t Geometry::num_vertices() const
+{
+    return mapped_vertices.is_mapped() ? mapped_vertices.size() : vertex_buf.size();
+}
+
+void Geometry::update_vertices(const MappedArray<glm::vec3> &verts,
+                               const MappedArray<glm::vec3> &normals)
+{
+    if (verts.size() != num_vertices() || normals.size() != normal_buf.size()) {
+        throw std::runtime_error("Geometry::update_vertices: vertex count changed");
+    }
+    // Mapped vertices are read-only, so switch to our own vertex buffer
+    if (mapped_vertices.is_mapped()) {
+        mapped_vertices.clear();
+        vertex_buf.resize(verts.size());
+
+        rtcReleaseBuffer(vbuf);
+        vbuf = 0;
+        rtcSetSharedGeometryBuffer(geom,
+                                   RTC_BUFFER_TYPE_VERTEX,
+                                   0,
+                                   RTC_FORMAT_FLOAT3,
+                                   vertex_buf.data(),
+                                   0,
+                                   sizeof(glm::vec4),
+                                   vertex_buf.size());
+    }
+    // Overwrite the existing vertex buffer so the pointer shared with Embree stays valid
+    std::transform(verts.begin(), verts.end(), vertex_buf.begin(), [](const glm::vec3 &v) {
+        return glm::vec4(v, 0.f);
+    });
+    normal_buf = normals;
+
+    rtcUpdateGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0);
+    rtcSetGeometryBuildQuality(geom, RTC_BUILD_QUALITY_REFIT);
+    rtcCommitGeometry(geom);
+}
+
+ISPCGeometry::ISPCGeometry(const Geometry &geom) : index_buf(geom.index_buf.data())
 {
+    if (!geom.vertex_buf.empty()) {
+        vertex_buf = geom.vertex_buf.data();
+    }
+
     if (!geom.normal_buf.empty()) {
         normal_buf = geom.normal_buf.data();
     }
@@ -66,11 +247,20 @@ ISPCGeometry::ISPCGeometry(const Geometry &geom)
     if (!geom.uv_buf.empty()) {
         uv_buf = geom.uv_buf.data();
     }
+
+    if (!geom.quad_tris.empty()) {
+        quad_tris = geom.quad_tris.data();
+    }
 }
 
-TriangleMesh::TriangleMesh(RTCDevice &device, std::vector<std::shared_ptr<Geometry>> &geoms)
-    : scene(rtcNewScene(device)), geometries(geoms)
+TriangleMesh::TriangleMesh(RTCDevice &device,
+                           std::vector<std::shared_ptr<Geometry>> &geoms,
+                           const BVHBuildOptions &build_options)
+    : scene(rtcNewScene(device)), flags(build_options.flags), geometries(geoms)
 {
+    rtcSetSceneBuildQuality(scene, build_options.quality);
+    rtcSetSceneFlags(scene, flags);
+
     ispc_geometries.reserve(geometries.size());
     std::transform(geometries.begin(),
                    geometries.end(),
@@ -95,6 +285,18 @@ RTCScene TriangleMesh::handle()
     return scene;
 }
 
+void TriangleMesh::refit()
+{
+    if (!dynamic) {
+        rtcSetSceneFlags(scene, RTCSceneFlags(flags | RTC_SCENE_FLAG_DYNAMIC));
+        dynamic = true;
+    }
+    for (size_t i = 0; i < geometries.size(); ++i) {
+        ispc_geometries[i] = ISPCGeometry(*geometries[i]);
+    }
+    rtcCommitScene(scene);
+}
+
 Instance::Instance(RTCDevice &device,
                    std::shared_ptr<TriangleMesh> &mesh,
                    const glm::mat4 &xfm,
@@ -118,6 +320,16 @@ Instance::~Instance()
     }
 }
 
+void Instance::set_transform(const glm::mat4 &xfm)
+{
+    // The ISPCInstance points to the matrices, so it sees the new transform as well
+    object_to_world = xfm;
+    world_to_object = glm::inverse(object_to_world);
+    rtcSetGeometryTransform(
+        handle, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, glm::value_ptr(object_to_world));
+    rtcCommitGeometry(handle);
+}
+
 ISPCInstance::ISPCInstance(const Instance &instance)
     : geometries(instance.mesh->ispc_geometries.data()),
       object_to_world(glm::value_ptr(instance.object_to_world)),
@@ -126,9 +338,13 @@ ISPCInstance::ISPCInstance(const Instance &instance)
 {
 }
 
-TopLevelBVH::TopLevelBVH(RTCDevice &device, const std::vector<std::shared_ptr<Instance>> &inst)
+TopLevelBVH::TopLevelBVH(RTCDevice &device,
+                         const std::vector<std::shared_ptr<Instance>> &inst,
+                         const BVHBuildOptions &build_options)
     : handle(rtcNewScene(device)), instances(inst)
 {
+    rtcSetSceneBuildQuality(handle, build_options.quality);
+    rtcSetSceneFlags(handle, build_options.flags);
     for (const auto &i : instances) {
         rtcAttachGeometry(handle, i->handle);
         ispc_instances.push_back(*i);
@@ -143,8 +359,29 @@ TopLevelBVH::~TopLevelBVH()
     }
 }
 
+void TopLevelBVH::commit()
+{
+    rtcCommitScene(handle);
+}
+
 ISPCTexture2D::ISPCTexture2D(const Image &img)
     : width(img.width), height(img.height), channels(img.channels), data(img.img.data())
 {
 }
+
+MaterialParams::MaterialParams(const DisneyMaterial &m)
+    : base_color(m.base_color),
+      metallic(m.metallic),
+      specular(m.specular),
+      roughness(m.roughness),
+      specular_tint(m.specular_tint),
+      anisotropy(m.anisotropy),
+      sheen(m.sheen),
+      sheen_tint(m.sheen_tint),
+      clearcoat(m.clearcoat),
+      clearcoat_gloss(m.clearcoat_gloss),
+      ior(m.ior),
+      specular_transmission(m.specular_transmission)
+{
+}
 }
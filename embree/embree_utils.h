@@ -1,20 +1,48 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 #include <embree3/rtcore.h>
+#include "environment_map.h"
+#include "light_sampling.h"
 #include "lights.h"
+#include "mapped_array.h"
 #include "material.h"
 #include <glm/glm.hpp>
 
 namespace embree {
 
+// Options for how the mesh and top-level BVHs are built
+struct BVHBuildOptions {
+    // Low quality builds are fastest, high quality builds use spatial splits to give
+    // the best BVH for tracing
+    RTCBuildQuality quality = RTC_BUILD_QUALITY_MEDIUM;
+    // Scene flags to build the BVHs with, e.g., RTC_SCENE_FLAG_COMPACT to reduce memory
+    // use or RTC_SCENE_FLAG_ROBUST to avoid missing hits along edges
+    RTCSceneFlags flags = RTC_SCENE_FLAG_NONE;
+    // Pair adjacent, nearly coplanar triangles into quads to reduce BVH size and the
+    // number of primitives visited while tracing
+    bool quads = false;
+};
+
+// Parse the build quality from its name: low, medium or high
+RTCBuildQuality parse_bvh_quality(const std::string &name);
+
 struct Geometry {
+    // The vertices are copied into vertex_buf with the padding Embree requires, unless they
+    // reference a mapped file, in which case Embree reads them directly from mapped_vertices
     std::vector<glm::vec4> vertex_buf;
-    std::vector<glm::uvec3> index_buf;
-    std::vector<glm::vec3> normal_buf;
-    std::vector<glm::vec2> uv_buf;
+    MappedArray<glm::vec3> mapped_vertices;
+    MappedArray<glm::uvec3> index_buf;
+    MappedArray<glm::vec3> normal_buf;
+    MappedArray<glm::vec2> uv_buf;
+
+    // If built as quads, the quad indices and the indices of the two triangles in
+    // index_buf making up each quad
+    std::vector<glm::uvec4> quad_buf;
+    std::vector<glm::uvec2> quad_tris;
 
     RTCBuffer vbuf = 0;
     RTCBuffer ibuf = 0;
@@ -23,16 +51,29 @@ struct Geometry {
 
     Geometry() = default;
 
+    /* Mapped arrays are shared with Embree and ISPC without copying them. Mapped vertices
+     * must be readable 16 bytes past their end, as Embree reads them with SIMD loads
+     */
     Geometry(RTCDevice &device,
-             const std::vector<glm::vec3> &verts,
-             const std::vector<glm::uvec3> &indices,
-             const std::vector<glm::vec3> &normals,
-             const std::vector<glm::vec2> &uvs);
+             const MappedArray<glm::vec3> &verts,
+             const MappedArray<glm::uvec3> &indices,
+             const MappedArray<glm::vec3> &normals,
+             const MappedArray<glm::vec2> &uvs,
+             const BVHBuildOptions &build_options = BVHBuildOptions());
 
     ~Geometry();
 
     Geometry(const Geometry &) = delete;
     Geometry &operator=(const Geometry &) = delete;
+
+    size_t num_vertices() const;
+
+    /* Update the vertex positions and normals, which must be the same size as the existing
+     * ones. The geometry is marked to have its BVH refit when the mesh containing it is
+     * recommitted, which also updates the pointers shared with ISPC
+     */
+    void update_vertices(const MappedArray<glm::vec3> &verts,
+                         const MappedArray<glm::vec3> &normals);
 };
 
 struct ISPCGeometry {
@@ -40,6 +81,7 @@ struct ISPCGeometry {
     const glm::uvec3 *index_buf = nullptr;
     const glm::vec3 *normal_buf = nullptr;
     const glm::vec2 *uv_buf = nullptr;
+    const glm::uvec2 *quad_tris = nullptr;
 
     ISPCGeometry() = default;
     ISPCGeometry(const Geometry &geom);
@@ -47,6 +89,8 @@ struct ISPCGeometry {
 
 class TriangleMesh {
     RTCScene scene = 0;
+    RTCSceneFlags flags = RTC_SCENE_FLAG_NONE;
+    bool dynamic = false;
 
 public:
     std::vector<std::shared_ptr<Geometry>> geometries;
@@ -54,7 +98,9 @@ public:
 
     TriangleMesh() = default;
 
-    TriangleMesh(RTCDevice &device, std::vector<std::shared_ptr<Geometry>> &geometries);
+    TriangleMesh(RTCDevice &device,
+                 std::vector<std::shared_ptr<Geometry>> &geometries,
+                 const BVHBuildOptions &build_options = BVHBuildOptions());
 
     ~TriangleMesh();
 
@@ -62,6 +108,12 @@ public:
     TriangleMesh &operator=(const TriangleMesh &) = delete;
 
     RTCScene handle();
+
+    /* Refit the BVH after updating the vertices of its geometries. The first refit marks
+     * the scene as dynamic, which rebuilds it once with a BVH suited to refitting. The ISPC
+     * geometries are updated in place, as the geometries' buffers may have moved
+     */
+    void refit();
 };
 
 struct Instance {
@@ -81,6 +133,9 @@ struct Instance {
 
     Instance(const Instance &) = delete;
     Instance &operator=(const Instance &) = delete;
+
+    // Set a new transform for the instance, the scene it's in must be recommitted after
+    void set_transform(const glm::mat4 &object_to_world);
 };
 
 struct ISPCInstance {
@@ -99,11 +154,16 @@ struct TopLevelBVH {
     std::vector<ISPCInstance> ispc_instances;
 
     TopLevelBVH() = default;
-    TopLevelBVH(RTCDevice &device, const std::vector<std::shared_ptr<Instance>> &instances);
+    TopLevelBVH(RTCDevice &device,
+                const std::vector<std::shared_ptr<Instance>> &instances,
+                const BVHBuildOptions &build_options = BVHBuildOptions());
     ~TopLevelBVH();
 
     TopLevelBVH(const TopLevelBVH &) = delete;
     TopLevelBVH &operator=(const TopLevelBVH &) = delete;
+
+    // Rebuild the BVH after changing the instances' transforms
+    void commit();
 };
 
 struct ISPCTexture2D {
@@ -132,11 +192,17 @@ struct MaterialParams {
 
     float ior = 1.5;
     float specular_transmission = 0;
+
+    MaterialParams() = default;
+    MaterialParams(const DisneyMaterial &m);
 };
 
 struct ViewParams {
     glm::vec3 pos, dir_du, dir_dv, dir_top_left;
     uint32_t frame_id;
+    uint32_t max_depth;
+    uint32_t roulette_min_depth;
+    uint32_t sampler;
 };
 
 struct SceneContext {
@@ -146,6 +212,17 @@ struct SceneContext {
     QuadLight *lights;
     ISPCTexture2D *textures;
     uint32_t num_lights;
+    uint32_t light_sampling;
+    LightAliasEntry *light_alias;
+    LightBVHNode *light_bvh;
+    ISPCEnvironmentMap *environment;
+};
+
+// Mirrors FeatureBuffers in render_embree.ispc
+struct FeatureBuffers {
+    float *albedo = nullptr;
+    float *normal = nullptr;
+    float *depth = nullptr;
 };
 
 struct Tile {
@@ -154,6 +231,22 @@ struct Tile {
     uint32_t fb_width, fb_height;
     float *data;
     uint16_t *ray_stats;
+    // The number of active lanes summed over each iteration of the integrator's path loop,
+    // and the number of lanes available over those iterations
+    uint64_t active_lanes = 0;
+    uint64_t lane_slots = 0;
+    // The adaptive sampling state, these are null if adaptive sampling is disabled.
+    // The number of samples taken and mean squared luminance of each pixel, along with
+    // which 8x8 pixel blocks of the tile still need more samples
+    uint32_t *sample_count = nullptr;
+    float *lum_sq_mean = nullptr;
+    uint8_t *block_active = nullptr;
+    // The AOV buffers, these are null if AOVs are disabled
+    float *aov_depth = nullptr;
+    float *aov_normal = nullptr;
+    float *aov_albedo = nullptr;
+    uint32_t *aov_instance_id = nullptr;
+    uint32_t *aov_material_id = nullptr;
 };
 
 }
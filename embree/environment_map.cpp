@@ -0,0 +1,63 @@
+#include "environment_map.h"
+#include <cmath>
+#include <tbb/parallel_for.h>
+#include <glm/ext.hpp>
+
+namespace embree {
+
+namespace {
+
+/* Compute the running sum of the values in cdf, which must have one more entry than
+ * the number of values, normalizing the CDF to [0, 1] and returning the sum. If all the
+ * values are zero the CDF is set to be uniform
+ */
+float build_cdf(float *cdf, const size_t n)
+{
+    float sum = 0.f;
+    cdf[0] = 0.f;
+    for (size_t i = 1; i <= n; ++i) {
+        sum += cdf[i];
+        cdf[i] = sum;
+    }
+    for (size_t i = 1; i <= n; ++i) {
+        cdf[i] = sum > 0.f ? cdf[i] / sum : static_cast<float>(i) / n;
+    }
+    cdf[n] = 1.f;
+    return sum;
+}
+
+}
+
+EnvironmentMap::EnvironmentMap(const HDRImage &img) : image(img)
+{
+    const size_t width = image.width;
+    const size_t height = image.height;
+    marginal_cdf.resize(height + 1, 0.f);
+    conditional_cdf.resize(height * (width + 1), 0.f);
+
+    tbb::parallel_for(size_t(0), height, [&](size_t y) {
+        // Weight the rows by sin(theta) to account for the distortion of the
+        // equirectangular projection towards the poles
+        const float sin_theta = std::sin(glm::pi<float>() * (y + 0.5f) / height);
+        float *row_cdf = &conditional_cdf[y * (width + 1)];
+        for (size_t x = 0; x < width; ++x) {
+            const float *px = &image.img[(y * width + x) * 3];
+            row_cdf[x + 1] = (0.2126f * px[0] + 0.7152f * px[1] + 0.0722f * px[2]) * sin_theta;
+        }
+        marginal_cdf[y + 1] = build_cdf(row_cdf, width);
+    });
+    build_cdf(marginal_cdf.data(), height);
+}
+
+ISPCEnvironmentMap EnvironmentMap::ispc_environment() const
+{
+    ISPCEnvironmentMap env;
+    env.width = image.width;
+    env.height = image.height;
+    env.radiance = image.img.data();
+    env.marginal_cdf = marginal_cdf.data();
+    env.conditional_cdf = conditional_cdf.data();
+    return env;
+}
+
+}
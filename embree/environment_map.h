@@ -0,0 +1,36 @@
+#pragma once
+
+#include <vector>
+#include "material.h"
+
+namespace embree {
+
+struct ISPCEnvironmentMap {
+    int width = -1;
+    int height = -1;
+    const float *radiance = nullptr;
+    const float *marginal_cdf = nullptr;
+    const float *conditional_cdf = nullptr;
+};
+
+/* An equirectangular HDR environment map along with the CDFs used to importance sample
+ * it. Each pixel is sampled with probability proportional to its luminance times the
+ * sin(theta) of its row, by first picking a row from the marginal CDF and then a pixel
+ * in the row from the row's conditional CDF
+ */
+struct EnvironmentMap {
+    HDRImage image;
+    // The marginal CDF over the rows, with height + 1 entries
+    std::vector<float> marginal_cdf;
+    // The conditional CDF of each row, with width + 1 entries per row
+    std::vector<float> conditional_cdf;
+
+    EnvironmentMap(const HDRImage &image);
+
+    EnvironmentMap(const EnvironmentMap &) = delete;
+    EnvironmentMap &operator=(const EnvironmentMap &) = delete;
+
+    ISPCEnvironmentMap ispc_environment() const;
+};
+
+}
@@ -0,0 +1,181 @@
+#include "light_sampling.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <glm/ext.hpp>
+
+namespace embree {
+
+namespace {
+
+struct LightBounds {
+    glm::vec3 lower = glm::vec3(std::numeric_limits<float>::infinity());
+    glm::vec3 upper = glm::vec3(-std::numeric_limits<float>::infinity());
+
+    void extend(const glm::vec3 &p)
+    {
+        lower = glm::min(lower, p);
+        upper = glm::max(upper, p);
+    }
+
+    void extend(const LightBounds &b)
+    {
+        lower = glm::min(lower, b.lower);
+        upper = glm::max(upper, b.upper);
+    }
+
+    glm::vec3 center() const
+    {
+        return 0.5f * (lower + upper);
+    }
+};
+
+LightBounds quad_light_bounds(const QuadLight &light)
+{
+    const glm::vec3 p = glm::vec3(light.position);
+    const glm::vec3 dx = light.v_x * light.width;
+    const glm::vec3 dy = light.v_y * light.height;
+    LightBounds b;
+    b.extend(p);
+    b.extend(p + dx);
+    b.extend(p + dy);
+    b.extend(p + dx + dy);
+    return b;
+}
+
+uint32_t build_light_bvh_node(std::vector<LightBVHNode> &nodes,
+                              std::vector<uint32_t> &light_ids,
+                              const size_t begin,
+                              const size_t end,
+                              const std::vector<LightBounds> &bounds,
+                              const std::vector<float> &power)
+{
+    const uint32_t node_id = nodes.size();
+    nodes.emplace_back();
+
+    LightBounds node_bounds, centroid_bounds;
+    float node_power = 0.f;
+    for (size_t i = begin; i < end; ++i) {
+        node_bounds.extend(bounds[light_ids[i]]);
+        centroid_bounds.extend(bounds[light_ids[i]].center());
+        node_power += power[light_ids[i]];
+    }
+    nodes[node_id].bounds_min = node_bounds.lower;
+    nodes[node_id].bounds_max = node_bounds.upper;
+    nodes[node_id].power = node_power;
+
+    if (end - begin == 1) {
+        nodes[node_id].index = light_ids[begin];
+        nodes[node_id].leaf = 1;
+        return node_id;
+    }
+
+    // Split at the median light along the axis with the largest centroid extent
+    const glm::vec3 extent = centroid_bounds.upper - centroid_bounds.lower;
+    int axis = 0;
+    if (extent.y > extent[axis]) {
+        axis = 1;
+    }
+    if (extent.z > extent[axis]) {
+        axis = 2;
+    }
+    const size_t mid = (begin + end) / 2;
+    std::nth_element(light_ids.begin() + begin,
+                     light_ids.begin() + mid,
+                     light_ids.begin() + end,
+                     [&](const uint32_t a, const uint32_t b) {
+                         return bounds[a].center()[axis] < bounds[b].center()[axis];
+                     });
+
+    build_light_bvh_node(nodes, light_ids, begin, mid, bounds, power);
+    const uint32_t right = build_light_bvh_node(nodes, light_ids, mid, end, bounds, power);
+    nodes[node_id].index = right;
+    return node_id;
+}
+
+}
+
+float light_power(const QuadLight &light)
+{
+    const glm::vec3 emission = glm::vec3(light.emission);
+    const float luminance = glm::dot(emission, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    return luminance * light.width * light.height;
+}
+
+std::vector<LightAliasEntry> build_light_alias_table(const std::vector<QuadLight> &lights)
+{
+    std::vector<LightAliasEntry> table(lights.size());
+    if (lights.empty()) {
+        return table;
+    }
+
+    std::vector<float> power(lights.size());
+    std::transform(lights.begin(), lights.end(), power.begin(), light_power);
+    const float total_power = std::accumulate(power.begin(), power.end(), 0.f);
+    if (total_power <= 0.f) {
+        std::fill(power.begin(), power.end(), 1.f);
+    }
+    const float total = total_power <= 0.f ? power.size() : total_power;
+
+    // Build the table with Vose's alias method, scaling the probabilities so the
+    // average entry has probability 1
+    std::vector<float> scaled(lights.size());
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < lights.size(); ++i) {
+        table[i].pdf = power[i] / total;
+        scaled[i] = table[i].pdf * lights.size();
+        if (scaled[i] < 1.f) {
+            small.push_back(i);
+        } else {
+            large.push_back(i);
+        }
+    }
+    while (!small.empty() && !large.empty()) {
+        const uint32_t s = small.back();
+        small.pop_back();
+        const uint32_t l = large.back();
+        large.pop_back();
+
+        table[s].prob = scaled[s];
+        table[s].alias = l;
+
+        scaled[l] = (scaled[l] + scaled[s]) - 1.f;
+        if (scaled[l] < 1.f) {
+            small.push_back(l);
+        } else {
+            large.push_back(l);
+        }
+    }
+    // Any remaining entries have probability 1, up to floating point error
+    for (const auto &i : small) {
+        table[i].prob = 1.f;
+        table[i].alias = i;
+    }
+    for (const auto &i : large) {
+        table[i].prob = 1.f;
+        table[i].alias = i;
+    }
+    return table;
+}
+
+std::vector<LightBVHNode> build_light_bvh(const std::vector<QuadLight> &lights)
+{
+    std::vector<LightBVHNode> nodes;
+    if (lights.empty()) {
+        return nodes;
+    }
+
+    std::vector<LightBounds> bounds(lights.size());
+    std::transform(lights.begin(), lights.end(), bounds.begin(), quad_light_bounds);
+    std::vector<float> power(lights.size());
+    std::transform(lights.begin(), lights.end(), power.begin(), light_power);
+
+    std::vector<uint32_t> light_ids(lights.size());
+    std::iota(light_ids.begin(), light_ids.end(), 0);
+
+    nodes.reserve(2 * lights.size() - 1);
+    build_light_bvh_node(nodes, light_ids, 0, light_ids.size(), bounds, power);
+    return nodes;
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include "lights.h"
+#include <glm/glm.hpp>
+
+namespace embree {
+
+// An entry in the alias table for selecting lights proportional to their power
+struct LightAliasEntry {
+    float prob = 1.f;
+    uint32_t alias = 0;
+    // The probability of selecting this entry's light
+    float pdf = 0.f;
+};
+
+struct LightBVHNode {
+    glm::vec3 bounds_min = glm::vec3(0.f);
+    float power = 0.f;
+    glm::vec3 bounds_max = glm::vec3(0.f);
+    // For interior nodes the index of the right child, the left child immediately follows
+    // its parent. For leaf nodes the index of the light
+    uint32_t index = 0;
+    uint32_t leaf = 0;
+};
+
+// Compute the emitted power of the light, up to a constant factor
+float light_power(const QuadLight &light);
+
+// Build an alias table to select lights with probability proportional to their power
+std::vector<LightAliasEntry> build_light_alias_table(const std::vector<QuadLight> &lights);
+
+/* Build a BVH over the lights, with a light in each leaf. The lights are selected by
+ * traversing the BVH and picking each child based on an estimate of how much its lights
+ * contribute to the shading point
+ */
+std::vector<LightBVHNode> build_light_bvh(const std::vector<QuadLight> &lights);
+
+}
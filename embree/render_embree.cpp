@@ -5,17 +5,156 @@
 #include <limits>
 #include <numeric>
 #include <pmmintrin.h>
+#include <stdexcept>
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
 #include <util.h>
 #include <xmmintrin.h>
 #include "render_embree_ispc.h"
 #include <glm/ext.hpp>
 
-RenderEmbree::RenderEmbree()
+std::string embree_option_usage()
+{
+    return "Embree Options:\n"
+        "\t-wavefront             Use the wavefront (ray stream) integrator\n"
+        "\t-sort-materials        Sort hits by material before shading (implies -wavefront)\n"
+        "\t-regenerate            Start new paths in idle ISPC lanes (without -wavefront)\n"
+        "\t-adaptive <err>        Stop sampling pixels once their relative error is below err\n"
+        "\t-adaptive-min-spp <n>  Samples per-pixel to take before checking convergence.\n"
+        "\t                       Defaults to 16\n"
+        "\t-tile-size <n|auto>    Tile size in pixels, or pick one based on the image size\n"
+        "\t                       and thread count. Defaults to 64\n"
+        "\t-tile-order <order>    Order to render tiles in: scanline, morton or hilbert.\n"
+        "\t                       Defaults to hilbert\n"
+        "\t-cost-schedule         Start the tiles which were slowest last frame first\n"
+        "\t-sampler <lcg|sobol>   Sampler to use, random (lcg) or Owen scrambled Sobol.\n"
+        "\t                       Defaults to lcg\n"
+        "\t-light-sampling <mode> How to pick the light to sample: uniform, power or bvh.\n"
+        "\t                       Defaults to bvh\n"
+        "\t-env <file.hdr>        Light the scene with an equirectangular HDR environment map\n"
+        "\t-denoise               Denoise the image, guided by the albedo, normals and depth\n"
+        "\t-aovs                  Write the depth, normal, albedo and IDs of the first hit to\n"
+        "\t                       AOV buffers\n"
+        "\t-bvh-quality <q>       BVH build quality: low, medium or high. Defaults to medium\n"
+        "\t-bvh-compact           Build compact BVHs, which use less memory\n"
+        "\t-bvh-robust            Build robust BVHs, which avoid missing hits along edges\n"
+        "\t-quads                 Pair adjacent, nearly coplanar triangles into quads\n"
+        "\t-embree-config <str>   Embree device config string, e.g., threads=8,isa=avx2\n";
+}
+
+bool parse_embree_option(EmbreeOptions &options, const std::vector<std::string> &args, size_t &i)
+{
+    if (args[i] == "-wavefront") {
+        options.wavefront = true;
+        return true;
+    }
+    if (args[i] == "-sort-materials") {
+        options.wavefront = true;
+        options.sort_materials = true;
+        return true;
+    }
+    if (args[i] == "-regenerate") {
+        options.path_regeneration = true;
+        return true;
+    }
+    if (args[i] == "-adaptive") {
+        options.adaptive_threshold = std::stof(args[++i]);
+        return true;
+    }
+    if (args[i] == "-adaptive-min-spp") {
+        options.adaptive_min_samples = std::stoul(args[++i]);
+        return true;
+    }
+    if (args[i] == "-tile-size") {
+        ++i;
+        if (args[i] == "auto") {
+            options.tile_size = 0;
+        } else {
+            // Tiles must be a multiple of the 8x8 adaptive sampling blocks
+            const uint32_t size = std::max(std::stoi(args[i]), 8);
+            options.tile_size = ((size + 7) / 8) * 8;
+        }
+        return true;
+    }
+    if (args[i] == "-tile-order") {
+        options.tile_order = parse_tile_order(args[++i]);
+        return true;
+    }
+    if (args[i] == "-cost-schedule") {
+        options.cost_schedule = true;
+        return true;
+    }
+    if (args[i] == "-sampler") {
+        ++i;
+        if (args[i] == "lcg") {
+            options.sampler = SamplerType::LCG;
+        } else if (args[i] == "sobol") {
+            options.sampler = SamplerType::SOBOL;
+        } else {
+            throw std::runtime_error("Invalid sampler " + args[i] + ", must be lcg or sobol");
+        }
+        return true;
+    }
+    if (args[i] == "-light-sampling") {
+        ++i;
+        if (args[i] == "uniform") {
+            options.light_sampling = LightSampling::UNIFORM;
+        } else if (args[i] == "power") {
+            options.light_sampling = LightSampling::POWER;
+        } else if (args[i] == "bvh") {
+            options.light_sampling = LightSampling::BVH;
+        } else {
+            throw std::runtime_error("Invalid light sampling " + args[i] +
+                                     ", must be uniform, power or bvh");
+        }
+        return true;
+    }
+    if (args[i] == "-denoise") {
+        options.denoise = true;
+        return true;
+    }
+    if (args[i] == "-aovs") {
+        options.aovs = true;
+        return true;
+    }
+    if (args[i] == "-bvh-quality") {
+        options.bvh.quality = embree::parse_bvh_quality(args[++i]);
+        return true;
+    }
+    if (args[i] == "-bvh-compact") {
+        options.bvh.flags = RTCSceneFlags(options.bvh.flags | RTC_SCENE_FLAG_COMPACT);
+        return true;
+    }
+    if (args[i] == "-quads") {
+        options.bvh.quads = true;
+        return true;
+    }
+    if (args[i] == "-bvh-robust") {
+        options.bvh.flags = RTCSceneFlags(options.bvh.flags | RTC_SCENE_FLAG_ROBUST);
+        return true;
+    }
+    if (args[i] == "-embree-config") {
+        options.device_config = args[++i];
+        return true;
+    }
+    if (args[i] == "-env") {
+        options.environment_map = args[++i];
+        canonicalize_path(options.environment_map);
+        return true;
+    }
+    return false;
+}
+
+RenderEmbree::RenderEmbree(const EmbreeOptions &options) : options(options)
 {
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
     _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
-    device = rtcNewDevice(nullptr);
+    device =
+        rtcNewDevice(options.device_config.empty() ? nullptr : options.device_config.c_str());
+    if (!device) {
+        throw std::runtime_error("Failed to create Embree device with config '" +
+                                 options.device_config + "'");
+    }
 }
 
 RenderEmbree::~RenderEmbree()
@@ -25,7 +164,44 @@ RenderEmbree::~RenderEmbree()
 
 std::string RenderEmbree::name()
 {
-    return "Embree (w/ TBB & ISPC)";
+    std::string name = "Embree (w/ TBB & ISPC";
+    if (options.wavefront) {
+        name += ", wavefront";
+        if (options.sort_materials) {
+            name += ", material sorted";
+        }
+    } else if (options.path_regeneration) {
+        name += ", path regeneration";
+    }
+    if (options.adaptive_threshold > 0.f) {
+        name += ", adaptive";
+    }
+    if (options.sampler == SamplerType::SOBOL) {
+        name += ", Sobol";
+    }
+    if (options.denoise) {
+        name += ", denoised";
+    }
+    if (options.bvh.quality == RTC_BUILD_QUALITY_LOW) {
+        name += ", low quality BVH";
+    } else if (options.bvh.quality == RTC_BUILD_QUALITY_HIGH) {
+        name += ", high quality BVH";
+    }
+    if (options.bvh.flags & RTC_SCENE_FLAG_COMPACT) {
+        name += ", compact BVH";
+    }
+    if (options.bvh.flags & RTC_SCENE_FLAG_ROBUST) {
+        name += ", robust BVH";
+    }
+    if (options.bvh.quads) {
+        name += ", quads";
+    }
+    if (options.light_sampling == LightSampling::UNIFORM) {
+        name += ", uniform lights";
+    } else if (options.light_sampling == LightSampling::POWER) {
+        name += ", power lights";
+    }
+    return name + ")";
 }
 
 void RenderEmbree::initialize(const int fb_width, const int fb_height)
@@ -34,8 +210,15 @@ void RenderEmbree::initialize(const int fb_width, const int fb_height)
     fb_dims = glm::ivec2(fb_width, fb_height);
     img.resize(fb_width * fb_height);
 
+    if (options.tile_size == 0) {
+        tile_size = auto_tile_size(fb_dims);
+    } else {
+        tile_size = glm::uvec2(options.tile_size);
+    }
+
     const glm::uvec2 ntiles(fb_dims.x / tile_size.x + (fb_dims.x % tile_size.x != 0 ? 1 : 0),
                             fb_dims.y / tile_size.y + (fb_dims.y % tile_size.y != 0 ? 1 : 0));
+    scheduler.initialize(ntiles, options.tile_order);
     tiles.resize(ntiles.x * ntiles.y);
     ray_stats.resize(tiles.size());
     for (size_t i = 0; i < tiles.size(); ++i) {
@@ -43,33 +226,102 @@ void RenderEmbree::initialize(const int fb_width, const int fb_height)
         ray_stats[i].resize(tile_size.x * tile_size.y, 0);
     }
 
+    if (options.adaptive_threshold > 0.f) {
+        const size_t blocks_per_tile = (tile_size.x / 8) * (tile_size.y / 8);
+        sample_counts.resize(tiles.size());
+        lum_sq_means.resize(tiles.size());
+        active_blocks.resize(tiles.size());
+        active_tiles.resize(tiles.size());
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            sample_counts[i].resize(tile_size.x * tile_size.y);
+            lum_sq_means[i].resize(tile_size.x * tile_size.y);
+            active_blocks[i].resize(blocks_per_tile);
+        }
+    }
+
+    if (options.denoise) {
+        denoiser.initialize(fb_dims);
+    }
+
+    if (options.aovs) {
+        const size_t tile_pixels = tile_size.x * tile_size.y;
+        tile_aovs.resize(tiles.size());
+        for (auto &t : tile_aovs) {
+            t.depth.resize(tile_pixels, 0.f);
+            t.normal.resize(tile_pixels * 3, 0.f);
+            t.albedo.resize(tile_pixels * 3, 0.f);
+            t.instance_id.resize(tile_pixels, RTC_INVALID_GEOMETRY_ID);
+            t.material_id.resize(tile_pixels, RTC_INVALID_GEOMETRY_ID);
+        }
+    }
+
 #ifdef REPORT_RAY_STATS
     num_rays.resize(tiles.size(), 0);
+    active_lanes.resize(tiles.size(), 0);
+    lane_slots.resize(tiles.size(), 0);
 #endif
 }
 
 void RenderEmbree::set_scene(const Scene &scene)
 {
+    using namespace std::chrono;
     frame_id = 0;
 
-    std::vector<std::shared_ptr<embree::TriangleMesh>> meshes;
-    for (const auto &mesh : scene.meshes) {
+    // The mesh BVHs are built concurrently with each other and with the texture, material
+    // and light setup. The instances and top-level BVH are built once the meshes are done
+    float mesh_time = 0.f;
+    float texture_time = 0.f;
+    float material_light_time = 0.f;
+    tbb::parallel_invoke([&]() { mesh_time = build_meshes(scene); },
+                         [&]() { texture_time = build_textures(scene); },
+                         [&]() { material_light_time = build_materials_lights(scene); });
+
+    auto start = high_resolution_clock::now();
+    std::vector<std::shared_ptr<embree::Instance>> instances(scene.instances.size());
+    tbb::parallel_for(size_t(0), instances.size(), [&](size_t i) {
+        const auto &inst = scene.instances[i];
+        instances[i] = std::make_shared<embree::Instance>(
+            device, meshes[inst.mesh_id], inst.transform, inst.material_ids);
+    });
+    auto end = high_resolution_clock::now();
+    const float instance_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+
+    start = high_resolution_clock::now();
+    scene_bvh = std::make_shared<embree::TopLevelBVH>(device, instances, options.bvh);
+    end = high_resolution_clock::now();
+    const float top_level_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+
+    set_scene_stage_times = {{"meshes", mesh_time},
+                             {"textures", texture_time},
+                             {"materials_lights", material_light_time},
+                             {"instances", instance_time},
+                             {"top_level_bvh", top_level_time}};
+}
+
+float RenderEmbree::build_meshes(const Scene &scene)
+{
+    using namespace std::chrono;
+    auto start = high_resolution_clock::now();
+
+    meshes.clear();
+    meshes.resize(scene.meshes.size());
+    tbb::parallel_for(size_t(0), meshes.size(), [&](size_t i) {
         std::vector<std::shared_ptr<embree::Geometry>> geometries;
-        for (const auto &geom : mesh.geometries) {
+        for (const auto &geom : scene.meshes[i].geometries) {
             geometries.push_back(std::make_shared<embree::Geometry>(
-                device, geom.vertices, geom.indices, geom.normals, geom.uvs));
+                device, geom.vertices, geom.indices, geom.normals, geom.uvs, options.bvh));
         }
+        meshes[i] = std::make_shared<embree::TriangleMesh>(device, geometries, options.bvh);
+    });
 
-        meshes.push_back(std::make_shared<embree::TriangleMesh>(device, geometries));
-    }
-
-    std::vector<std::shared_ptr<embree::Instance>> instances;
-    for (const auto &inst : scene.instances) {
-        instances.push_back(std::make_shared<embree::Instance>(
-            device, meshes[inst.mesh_id], inst.transform, inst.material_ids));
-    }
+    auto end = high_resolution_clock::now();
+    return duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+}
 
-    scene_bvh = std::make_shared<embree::TopLevelBVH>(device, instances);
+float RenderEmbree::build_textures(const Scene &scene)
+{
+    using namespace std::chrono;
+    auto start = high_resolution_clock::now();
 
     textures = scene.textures;
 
@@ -82,42 +334,125 @@ void RenderEmbree::set_scene(const Scene &scene)
         }
         img.color_space = LINEAR;
         const int convert_channels = std::min(3, img.channels);
+        // Get the image data before the loop, to copy it once if it references a mapped file
+        uint8_t *data = img.img.data();
         tbb::parallel_for(size_t(0), size_t(img.width) * img.height, [&](size_t px) {
             for (int c = 0; c < convert_channels; ++c) {
-                float x = img.img[px * img.channels + c] / 255.f;
+                float x = data[px * img.channels + c] / 255.f;
                 x = srgb_to_linear(x);
-                img.img[px * img.channels + c] = glm::clamp(x * 255.f, 0.f, 255.f);
+                data[px * img.channels + c] = glm::clamp(x * 255.f, 0.f, 255.f);
             }
         });
     });
 
+    ispc_textures.clear();
     ispc_textures.reserve(textures.size());
     std::transform(textures.begin(),
                    textures.end(),
                    std::back_inserter(ispc_textures),
                    [](const Image &img) { return embree::ISPCTexture2D(img); });
 
+    auto end = high_resolution_clock::now();
+    return duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+}
+
+float RenderEmbree::build_materials_lights(const Scene &scene)
+{
+    using namespace std::chrono;
+    auto start = high_resolution_clock::now();
+
+    material_params.clear();
     material_params.reserve(scene.materials.size());
-    for (const auto &m : scene.materials) {
-        embree::MaterialParams p;
+    std::transform(scene.materials.begin(),
+                   scene.materials.end(),
+                   std::back_inserter(material_params),
+                   [](const DisneyMaterial &m) { return embree::MaterialParams(m); });
 
-        p.base_color = m.base_color;
-        p.metallic = m.metallic;
-        p.specular = m.specular;
-        p.roughness = m.roughness;
-        p.specular_tint = m.specular_tint;
-        p.anisotropy = m.anisotropy;
-        p.sheen = m.sheen;
-        p.sheen_tint = m.sheen_tint;
-        p.clearcoat = m.clearcoat;
-        p.clearcoat_gloss = m.clearcoat_gloss;
-        p.ior = m.ior;
-        p.specular_transmission = m.specular_transmission;
+    lights = scene.lights;
+    light_alias = embree::build_light_alias_table(lights);
+    light_bvh = embree::build_light_bvh(lights);
 
-        material_params.push_back(p);
+    if (!options.environment_map.empty() && !environment) {
+        environment = std::make_unique<embree::EnvironmentMap>(
+            HDRImage(options.environment_map));
+        ispc_environment = environment->ispc_environment();
     }
 
-    lights = scene.lights;
+    auto end = high_resolution_clock::now();
+    return duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+}
+
+bool RenderEmbree::update_instances(const std::vector<uint32_t> &ids,
+                                    const std::vector<glm::mat4> &transforms)
+{
+    if (ids.size() != transforms.size()) {
+        throw std::runtime_error("update_instances: mismatched number of ids and transforms");
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (ids[i] >= scene_bvh->instances.size()) {
+            throw std::runtime_error("update_instances: invalid instance id " +
+                                     std::to_string(ids[i]));
+        }
+        scene_bvh->instances[ids[i]]->set_transform(transforms[i]);
+    }
+    // The meshes' BVHs are unchanged, only the top-level BVH over the instances is rebuilt
+    scene_bvh->commit();
+    frame_id = 0;
+    return true;
+}
+
+bool RenderEmbree::update_meshes(const std::vector<uint32_t> &mesh_ids, const Scene &scene)
+{
+    for (const auto &id : mesh_ids) {
+        if (id >= meshes.size() || id >= scene.meshes.size() ||
+            scene.meshes[id].geometries.size() != meshes[id]->geometries.size()) {
+            throw std::runtime_error("update_meshes: invalid or changed mesh " +
+                                     std::to_string(id));
+        }
+        const auto &geometries = scene.meshes[id].geometries;
+        tbb::parallel_for(size_t(0), geometries.size(), [&](size_t i) {
+            meshes[id]->geometries[i]->update_vertices(geometries[i].vertices,
+                                                       geometries[i].normals);
+        });
+        meshes[id]->refit();
+    }
+
+    // The instances of the refit meshes must be recommitted to update their bounds
+    for (auto &inst : scene_bvh->instances) {
+        const bool refit = std::any_of(mesh_ids.begin(), mesh_ids.end(), [&](uint32_t id) {
+            return meshes[id] == inst->mesh;
+        });
+        if (refit) {
+            rtcCommitGeometry(inst->handle);
+        }
+    }
+    scene_bvh->commit();
+    frame_id = 0;
+    return true;
+}
+
+bool RenderEmbree::update_materials(const std::vector<uint32_t> &ids,
+                                    const std::vector<DisneyMaterial> &materials)
+{
+    if (ids.size() != materials.size()) {
+        throw std::runtime_error("update_materials: mismatched number of ids and materials");
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (ids[i] >= material_params.size()) {
+            throw std::runtime_error("update_materials: invalid material id " +
+                                     std::to_string(ids[i]));
+        }
+        // The ISPC scene references the parameters directly, so no BVHs or textures change
+        material_params[ids[i]] = embree::MaterialParams(materials[i]);
+    }
+    frame_id = 0;
+    return true;
+}
+
+void RenderEmbree::set_path_params(const PathParams &params)
+{
+    path_params = params;
+    frame_id = 0;
 }
 
 RenderStats RenderEmbree::render(const glm::vec3 &pos,
@@ -126,6 +461,17 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
                                  const float fovy,
                                  const bool camera_changed,
                                  const bool readback_framebuffer)
+{
+    return render_samples(pos, dir, up, fovy, camera_changed, readback_framebuffer, 1);
+}
+
+RenderStats RenderEmbree::render_samples(const glm::vec3 &pos,
+                                         const glm::vec3 &dir,
+                                         const glm::vec3 &up,
+                                         const float fovy,
+                                         const bool camera_changed,
+                                         const bool readback_framebuffer,
+                                         const uint32_t samples_per_call)
 {
     using namespace std::chrono;
     RenderStats stats;
@@ -134,6 +480,17 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
         frame_id = 0;
     }
 
+    const bool adaptive = options.adaptive_threshold > 0.f;
+    if (adaptive && frame_id == 0) {
+        // Restart adaptive sampling for the new image
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            std::fill(sample_counts[i].begin(), sample_counts[i].end(), 0);
+            std::fill(lum_sq_means[i].begin(), lum_sq_means[i].end(), 0.f);
+            std::fill(active_blocks[i].begin(), active_blocks[i].end(), 1);
+        }
+        std::fill(active_tiles.begin(), active_tiles.end(), 1);
+    }
+
     glm::vec2 img_plane_size;
     img_plane_size.y = 2.f * std::tan(glm::radians(0.5f * fovy));
     img_plane_size.x = img_plane_size.y * static_cast<float>(fb_dims.x) / fb_dims.y;
@@ -145,6 +502,9 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
         -glm::normalize(glm::cross(view_params.dir_du, dir)) * img_plane_size.y;
     view_params.dir_top_left = dir - 0.5f * view_params.dir_du - 0.5f * view_params.dir_dv;
     view_params.frame_id = frame_id;
+    view_params.max_depth = path_params.max_depth;
+    view_params.roulette_min_depth = path_params.roulette_min_depth;
+    view_params.sampler = static_cast<uint32_t>(options.sampler);
 
     embree::SceneContext ispc_scene;
     ispc_scene.scene = scene_bvh->handle;
@@ -153,6 +513,10 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
     ispc_scene.textures = ispc_textures.data();
     ispc_scene.lights = lights.data();
     ispc_scene.num_lights = lights.size();
+    ispc_scene.light_sampling = static_cast<uint32_t>(options.light_sampling);
+    ispc_scene.light_alias = light_alias.data();
+    ispc_scene.light_bvh = light_bvh.data();
+    ispc_scene.environment = environment ? &ispc_environment : nullptr;
 
     // Round up the number of tiles we need to run in case the
     // framebuffer is not an even multiple of tile size
@@ -160,9 +524,19 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
                             fb_dims.y / tile_size.y + (fb_dims.y % tile_size.y != 0 ? 1 : 0));
 
     uint8_t *color = reinterpret_cast<uint8_t *>(img.data());
+    embree::FeatureBuffers features = denoiser.feature_buffers();
 
     auto start = high_resolution_clock::now();
-    tbb::parallel_for(uint32_t(0), ntiles.x * ntiles.y, [&](uint32_t tile_id) {
+    scheduler.parallel_for_tiles(options.cost_schedule, [&](const uint32_t tile_id) {
+        if (adaptive && !active_tiles[tile_id]) {
+#ifdef REPORT_RAY_STATS
+            num_rays[tile_id] = 0;
+            active_lanes[tile_id] = 0;
+            lane_slots[tile_id] = 0;
+#endif
+            return;
+        }
+
         const glm::uvec2 tile = glm::uvec2(tile_id % ntiles.x, tile_id / ntiles.x);
         const glm::uvec2 tile_pos = tile * tile_size;
         const glm::uvec2 tile_end = glm::min(tile_pos + tile_size, fb_dims);
@@ -177,27 +551,193 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
         ispc_tile.fb_height = fb_dims.y;
         ispc_tile.data = tiles[tile_id].data();
         ispc_tile.ray_stats = ray_stats[tile_id].data();
+        if (adaptive) {
+            ispc_tile.sample_count = sample_counts[tile_id].data();
+            ispc_tile.lum_sq_mean = lum_sq_means[tile_id].data();
+            ispc_tile.block_active = active_blocks[tile_id].data();
+        }
+        if (options.aovs) {
+            ispc_tile.aov_depth = tile_aovs[tile_id].depth.data();
+            ispc_tile.aov_normal = tile_aovs[tile_id].normal.data();
+            ispc_tile.aov_albedo = tile_aovs[tile_id].albedo.data();
+            ispc_tile.aov_instance_id = tile_aovs[tile_id].instance_id.data();
+            ispc_tile.aov_material_id = tile_aovs[tile_id].material_id.data();
+        }
 
-        ispc::trace_rays(&ispc_scene, &ispc_tile, &view_params);
+        // The denoiser's features are the same for each sample, so only compute them
+        // for the first sample of the image
+        if (options.denoise && frame_id == 0) {
+            ispc::trace_features(&ispc_scene, &ispc_tile, &view_params, &features);
+        }
 
-        ispc::tile_to_uint8(&ispc_tile, color);
+        // Take all the samples for the tile before converting it to the framebuffer
+        uint64_t tile_rays = 0;
+        uint64_t tile_active_lanes = 0;
+        uint64_t tile_lane_slots = 0;
+        embree::ViewParams sample_params = view_params;
+        for (uint32_t s = 0; s < samples_per_call; ++s) {
+            sample_params.frame_id = frame_id + s;
+            if (options.wavefront) {
+                tile_rays += render_tile_wavefront(ispc_scene, ispc_tile, sample_params);
+            } else {
+                if (options.path_regeneration) {
+                    ispc::trace_rays_regenerate(&ispc_scene, &ispc_tile, &sample_params);
+                } else {
+                    ispc::trace_rays(&ispc_scene, &ispc_tile, &sample_params);
+                }
+#ifdef REPORT_RAY_STATS
+                tile_rays += std::accumulate(
+                    ray_stats[tile_id].begin(),
+                    ray_stats[tile_id].end(),
+                    uint64_t(0),
+                    [](const uint64_t &total, const uint16_t &c) { return total + c; });
+#endif
+            }
+            tile_active_lanes += ispc_tile.active_lanes;
+            tile_lane_slots += ispc_tile.lane_slots;
+
+            if (adaptive) {
+                const uint32_t blocks_left = ispc::update_adaptive_blocks(
+                    &ispc_tile, options.adaptive_threshold, options.adaptive_min_samples);
+                active_tiles[tile_id] = blocks_left > 0;
+                if (!active_tiles[tile_id]) {
+                    break;
+                }
+            }
+        }
 #ifdef REPORT_RAY_STATS
-        num_rays[tile_id] = std::accumulate(
-            ray_stats[tile_id].begin(),
-            ray_stats[tile_id].end(),
-            uint64_t(0),
-            [](const uint64_t &total, const uint16_t &c) { return total + c; });
+        num_rays[tile_id] = tile_rays;
+        active_lanes[tile_id] = tile_active_lanes;
+        lane_slots[tile_id] = tile_lane_slots;
+#else
+        (void)tile_rays;
+        (void)tile_active_lanes;
+        (void)tile_lane_slots;
 #endif
+
+        if (!options.denoise) {
+            ispc::tile_to_uint8(&ispc_tile, color);
+        }
     });
+    if (options.denoise) {
+        denoiser.denoise(tiles, tile_size, color);
+    }
     auto end = high_resolution_clock::now();
     stats.render_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
 
 #ifdef REPORT_RAY_STATS
-    const uint64_t total_rays = std::accumulate(num_rays.begin(), num_rays.end(), 0);
+    const uint64_t total_rays = std::accumulate(num_rays.begin(), num_rays.end(), uint64_t(0));
     stats.rays_per_second = total_rays / (stats.render_time * 1.0e-3);
+
+    // The wavefront integrator compacts its queues, so lane occupancy isn't tracked for it
+    const uint64_t total_slots =
+        std::accumulate(lane_slots.begin(), lane_slots.end(), uint64_t(0));
+    if (total_slots > 0) {
+        stats.lane_occupancy =
+            std::accumulate(active_lanes.begin(), active_lanes.end(), uint64_t(0)) /
+            static_cast<double>(total_slots);
+    }
 #endif
 
-    ++frame_id;
+    if (adaptive) {
+        stats.converged = std::find(active_tiles.begin(), active_tiles.end(), 1) ==
+                          active_tiles.end();
+    }
+
+    frame_id += samples_per_call;
 
     return stats;
 }
+
+bool RenderEmbree::read_aov(const AOV aov, std::vector<float> &data)
+{
+    if (!options.aovs) {
+        return false;
+    }
+    switch (aov) {
+    case AOV::DEPTH:
+        gather_tiles(data, 1, [&](size_t i) { return tile_aovs[i].depth.data(); });
+        return true;
+    case AOV::NORMAL:
+        gather_tiles(data, 3, [&](size_t i) { return tile_aovs[i].normal.data(); });
+        return true;
+    case AOV::ALBEDO:
+        gather_tiles(data, 3, [&](size_t i) { return tile_aovs[i].albedo.data(); });
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool RenderEmbree::read_aov(const AOV aov, std::vector<uint32_t> &data)
+{
+    if (!options.aovs) {
+        return false;
+    }
+    switch (aov) {
+    case AOV::INSTANCE_ID:
+        gather_tiles(data, 1, [&](size_t i) { return tile_aovs[i].instance_id.data(); });
+        return true;
+    case AOV::MATERIAL_ID:
+        gather_tiles(data, 1, [&](size_t i) { return tile_aovs[i].material_id.data(); });
+        return true;
+    case AOV::SAMPLE_COUNT:
+        // Without adaptive sampling each pixel has taken the same number of samples
+        if (options.adaptive_threshold > 0.f) {
+            gather_tiles(data, 1, [&](size_t i) { return sample_counts[i].data(); });
+        } else {
+            data.clear();
+            data.resize(size_t(fb_dims.x) * fb_dims.y, frame_id);
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+uint64_t RenderEmbree::render_tile_wavefront(embree::SceneContext &ispc_scene,
+                                             embree::Tile &tile,
+                                             embree::ViewParams &view_params)
+{
+    embree::WavefrontBuffers &buffers = wavefront_buffers.local();
+    buffers.resize(tile_size.x * tile_size.y);
+    embree::WavefrontQueues &queues = buffers.queues;
+
+    RTCIntersectContext coherent, incoherent;
+    rtcInitIntersectContext(&coherent);
+    coherent.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+    rtcInitIntersectContext(&incoherent);
+    incoherent.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+    ispc::wavefront_camera_rays(&tile, &view_params, &queues);
+
+    uint64_t total_rays = 0;
+    for (uint32_t bounce = 0; queues.num_rays > 0; ++bounce) {
+        rtcIntersectNp(ispc_scene.scene,
+                       bounce == 0 ? &coherent : &incoherent,
+                       queues.rays,
+                       queues.num_rays);
+
+        if (options.sort_materials) {
+            buffers.sort_hits_by_material(scene_bvh->ispc_instances, material_params.size());
+        }
+        ispc::wavefront_shade(&ispc_scene, &view_params, &queues);
+
+        rtcOccludedNp(
+            ispc_scene.scene, &incoherent, queues.light_shadow, queues.num_light_shadow);
+        rtcOccludedNp(
+            ispc_scene.scene, &incoherent, queues.bsdf_shadow, queues.num_bsdf_shadow);
+
+        ispc::wavefront_resolve_shadows(&queues);
+
+        total_rays +=
+            queues.num_rays + queues.num_light_shadow + queues.num_bsdf_shadow;
+
+        std::swap(queues.rays, queues.next_rays);
+        queues.num_rays = queues.num_next_rays;
+    }
+
+    ispc::wavefront_accumulate(&tile, &view_params, &queues);
+
+    return total_rays;
+}
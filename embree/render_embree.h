@@ -1,42 +1,197 @@
 #pragma once
 
+#include <algorithm>
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 #include <embree3/rtcore.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include "denoiser.h"
 #include "embree_utils.h"
 #include "material.h"
 #include "render_backend.h"
+#include "tile_scheduler.h"
+#include "wavefront.h"
+
+// The samplers available in the Embree kernels, matching the SAMPLER_* values in sampler.ih
+enum class SamplerType : uint32_t { LCG = 0, SOBOL = 1 };
+
+// The strategies for selecting which light to sample, matching LIGHT_SAMPLING_* in
+// light_sampling.ih
+enum class LightSampling : uint32_t { UNIFORM = 0, POWER = 1, BVH = 2 };
+
+// Options for the Embree backend which can be set on the command line
+struct EmbreeOptions {
+    // Use the wavefront integrator, which traces each bounce for all paths in the tile
+    // as a ray stream and shades the hits in separate kernels
+    bool wavefront = false;
+
+    // Sort the hits by material before shading them in the wavefront integrator, so
+    // that each ISPC gang shades hits with the same material
+    bool sort_materials = false;
+
+    // Keep the ISPC lanes busy by starting a new path for the next pixel when a lane's
+    // path terminates, instead of waiting on the longest path in the gang
+    bool path_regeneration = false;
+
+    // Stop sampling 8x8 pixel blocks once the relative standard error of each pixel's
+    // luminance is below this threshold, adaptive sampling is disabled if this is 0
+    float adaptive_threshold = 0.f;
+    // The minimum number of samples to take per-pixel before checking for convergence
+    uint32_t adaptive_min_samples = 16;
+
+    // The tile size to use, if 0 the tile size is picked based on the framebuffer size
+    // and number of threads
+    uint32_t tile_size = 64;
+    TileOrder tile_order = TileOrder::HILBERT;
+    // Start the tiles which took the longest to render in the previous frame first,
+    // instead of keeping the same assignment of tiles to threads each frame
+    bool cost_schedule = false;
+
+    SamplerType sampler = SamplerType::LCG;
+
+    // Select lights uniformly, proportional to their power with an alias table, or by
+    // traversing a light BVH to pick lights likely to contribute to the shading point
+    LightSampling light_sampling = LightSampling::BVH;
+
+    // An equirectangular HDR image to light the scene with, which replaces the checkerboard
+    // background and is importance sampled for direct lighting
+    std::string environment_map;
+
+    // Denoise the image with an a-trous wavelet filter guided by the albedo, normal and
+    // depth of the first hit in each pixel
+    bool denoise = false;
+
+    // Write the first hit depth, normal, albedo, instance and material IDs of each pixel
+    // to AOV buffers which can be fetched with read_aov, along with the sample count
+    bool aovs = false;
+
+    // The build quality and scene flags to use for the BVHs
+    embree::BVHBuildOptions bvh;
+
+    // The Embree device configuration string, e.g., "threads=8,isa=avx2"
+    std::string device_config;
+};
+
+/* Parse the Embree backend option at args[i], advancing i past any values taken by the
+ * option. Returns false if args[i] is not an Embree option
+ */
+bool parse_embree_option(EmbreeOptions &options, const std::vector<std::string> &args, size_t &i);
+
+// The usage text listing the options accepted by parse_embree_option
+std::string embree_option_usage();
 
 struct RenderEmbree : RenderBackend {
+    EmbreeOptions options;
+
     RTCDevice device;
     glm::uvec2 fb_dims;
 
+    std::vector<std::shared_ptr<embree::TriangleMesh>> meshes;
     std::shared_ptr<embree::TopLevelBVH> scene_bvh;
 
     std::vector<embree::MaterialParams> material_params;
     std::vector<QuadLight> lights;
+    std::vector<embree::LightAliasEntry> light_alias;
+    std::vector<embree::LightBVHNode> light_bvh;
+    std::unique_ptr<embree::EnvironmentMap> environment;
+    embree::ISPCEnvironmentMap ispc_environment;
     std::vector<Image> textures;
     std::vector<embree::ISPCTexture2D> ispc_textures;
 
     uint32_t frame_id = 0;
     glm::uvec2 tile_size = glm::uvec2(64);
+    TileScheduler scheduler;
     std::vector<std::vector<float>> tiles;
     std::vector<std::vector<uint16_t>> ray_stats;
+
+    // Per-tile adaptive sampling state
+    std::vector<std::vector<uint32_t>> sample_counts;
+    std::vector<std::vector<float>> lum_sq_means;
+    std::vector<std::vector<uint8_t>> active_blocks;
+    std::vector<uint8_t> active_tiles;
+
+    // Per-tile AOV buffers
+    struct TileAOVs {
+        std::vector<float> depth, normal, albedo;
+        std::vector<uint32_t> instance_id, material_id;
+    };
+    std::vector<TileAOVs> tile_aovs;
 #ifdef REPORT_RAY_STATS
     std::vector<uint64_t> num_rays;
+    std::vector<uint64_t> active_lanes;
+    std::vector<uint64_t> lane_slots;
 #endif
 
-    RenderEmbree();
+    tbb::enumerable_thread_specific<embree::WavefrontBuffers> wavefront_buffers;
+
+    embree::Denoiser denoiser;
+
+    RenderEmbree(const EmbreeOptions &options = EmbreeOptions());
     ~RenderEmbree();
 
     std::string name() override;
     void initialize(const int fb_width, const int fb_height) override;
     void set_scene(const Scene &scene) override;
+    void set_path_params(const PathParams &params) override;
+    bool update_instances(const std::vector<uint32_t> &ids,
+                          const std::vector<glm::mat4> &transforms) override;
+    bool update_meshes(const std::vector<uint32_t> &mesh_ids, const Scene &scene) override;
+    bool update_materials(const std::vector<uint32_t> &ids,
+                          const std::vector<DisneyMaterial> &materials) override;
     RenderStats render(const glm::vec3 &pos,
                        const glm::vec3 &dir,
                        const glm::vec3 &up,
                        const float fovy,
                        const bool camera_changed,
                        const bool readback_framebuffer) override;
+    RenderStats render_samples(const glm::vec3 &pos,
+                               const glm::vec3 &dir,
+                               const glm::vec3 &up,
+                               const float fovy,
+                               const bool camera_changed,
+                               const bool readback_framebuffer,
+                               const uint32_t samples_per_call) override;
+    bool read_aov(const AOV aov, std::vector<float> &data) override;
+    bool read_aov(const AOV aov, std::vector<uint32_t> &data) override;
+
+    /* The stages of set_scene, which run concurrently. Each returns the time it took in
+     * milliseconds
+     */
+    float build_meshes(const Scene &scene);
+    float build_textures(const Scene &scene);
+    float build_materials_lights(const Scene &scene);
+
+    // Render the tile with the wavefront integrator, returns the number of rays traced
+    uint64_t render_tile_wavefront(embree::SceneContext &ispc_scene,
+                                   embree::Tile &tile,
+                                   embree::ViewParams &view_params);
+    /* Copy the per-tile buffers returned by tile_buffer(tile_id), with the given number
+     * of channels per-pixel, into a single image in the same pixel order as img
+     */
+    template <typename T, typename F>
+    void gather_tiles(std::vector<T> &data, const uint32_t channels, const F &tile_buffer);
 };
+
+template <typename T, typename F>
+void RenderEmbree::gather_tiles(std::vector<T> &data,
+                                const uint32_t channels,
+                                const F &tile_buffer)
+{
+    const glm::uvec2 ntiles(fb_dims.x / tile_size.x + (fb_dims.x % tile_size.x != 0 ? 1 : 0),
+                            fb_dims.y / tile_size.y + (fb_dims.y % tile_size.y != 0 ? 1 : 0));
+    data.resize(size_t(fb_dims.x) * fb_dims.y * channels);
+    tbb::parallel_for(size_t(0), tiles.size(), [&](size_t tile_id) {
+        const glm::uvec2 tile = glm::uvec2(tile_id % ntiles.x, tile_id / ntiles.x);
+        const glm::uvec2 tile_pos = tile * tile_size;
+        const glm::uvec2 tile_dims = glm::min(tile_pos + tile_size, fb_dims) - tile_pos;
+        const T *src = tile_buffer(tile_id);
+        for (uint32_t j = 0; j < tile_dims.y; ++j) {
+            std::copy(src + j * tile_dims.x * channels,
+                      src + (j + 1) * tile_dims.x * channels,
+                      data.begin() + ((tile_pos.y + j) * fb_dims.x + tile_pos.x) * channels);
+        }
+    });
+}
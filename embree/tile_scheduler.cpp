@@ -0,0 +1,123 @@
+#include "tile_scheduler.h"
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+#include <tbb/task_arena.h>
+
+namespace {
+
+// Compute the index of the point along the Morton (Z-order) curve
+uint64_t morton_index(const uint32_t x, const uint32_t y)
+{
+    uint64_t index = 0;
+    for (uint32_t i = 0; i < 32; ++i) {
+        index |= uint64_t((x >> i) & 1) << (2 * i);
+        index |= uint64_t((y >> i) & 1) << (2 * i + 1);
+    }
+    return index;
+}
+
+// Compute the index of the point along the Hilbert curve filling the n x n grid, where n
+// is a power of two
+uint64_t hilbert_index(const uint32_t n, uint32_t x, uint32_t y)
+{
+    uint64_t index = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        const uint32_t rx = (x & s) > 0 ? 1 : 0;
+        const uint32_t ry = (y & s) > 0 ? 1 : 0;
+        index += uint64_t(s) * s * ((3 * rx) ^ ry);
+        // Rotate the quadrant so the curve within it has the right orientation
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return index;
+}
+
+}
+
+TileOrder parse_tile_order(const std::string &name)
+{
+    if (name == "scanline") {
+        return TileOrder::SCANLINE;
+    }
+    if (name == "morton") {
+        return TileOrder::MORTON;
+    }
+    if (name == "hilbert") {
+        return TileOrder::HILBERT;
+    }
+    throw std::runtime_error("Invalid tile order " + name +
+                             ", must be one of scanline, morton or hilbert");
+}
+
+void TileScheduler::initialize(const glm::uvec2 &tiles, const TileOrder order)
+{
+    ntiles = tiles;
+    const uint32_t num_tiles = ntiles.x * ntiles.y;
+
+    std::vector<uint64_t> curve_index(num_tiles, 0);
+    uint32_t n = 1;
+    while (n < std::max(ntiles.x, ntiles.y)) {
+        n *= 2;
+    }
+    for (uint32_t i = 0; i < num_tiles; ++i) {
+        const uint32_t x = i % ntiles.x;
+        const uint32_t y = i / ntiles.x;
+        switch (order) {
+        case TileOrder::SCANLINE:
+            curve_index[i] = i;
+            break;
+        case TileOrder::MORTON:
+            curve_index[i] = morton_index(x, y);
+            break;
+        case TileOrder::HILBERT:
+            curve_index[i] = hilbert_index(n, x, y);
+            break;
+        }
+    }
+
+    spatial_order.resize(num_tiles);
+    std::iota(spatial_order.begin(), spatial_order.end(), 0);
+    std::sort(
+        spatial_order.begin(), spatial_order.end(), [&](const uint32_t a, const uint32_t b) {
+            return curve_index[a] < curve_index[b];
+        });
+
+    schedule = spatial_order;
+    tile_times.clear();
+    tile_times.resize(num_tiles, 0.f);
+}
+
+void TileScheduler::sort_by_cost()
+{
+    // Tiles with the same cost (e.g., on the first frame) keep their spatial order
+    schedule = spatial_order;
+    std::stable_sort(
+        schedule.begin(), schedule.end(), [&](const uint32_t a, const uint32_t b) {
+            return tile_times[a] > tile_times[b];
+        });
+}
+
+glm::uvec2 auto_tile_size(const glm::uvec2 &fb_dims)
+{
+    // Aim for at least 8 tiles per-thread so the expensive tiles can be balanced out,
+    // while keeping the tiles large enough to amortize the per-tile overhead. The
+    // tile size must be a multiple of 8 for the adaptive sampling blocks
+    const uint32_t min_tiles = 8 * tbb::this_task_arena::max_concurrency();
+    uint32_t size = 64;
+    while (size > 16) {
+        const uint32_t num_tiles =
+            ((fb_dims.x + size - 1) / size) * ((fb_dims.y + size - 1) / size);
+        if (num_tiles >= min_tiles) {
+            break;
+        }
+        size /= 2;
+    }
+    return glm::uvec2(size);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <glm/glm.hpp>
+
+enum class TileOrder { SCANLINE, MORTON, HILBERT };
+
+// Parse the tile order from its name, throws if the name is not a valid tile order
+TileOrder parse_tile_order(const std::string &name);
+
+/* Chooses the order in which the tiles of the framebuffer are rendered. The tiles are
+ * ordered along a space filling curve so nearby tiles are rendered close together in
+ * time. If cost scheduling is enabled the tiles which took the longest to render in
+ * the previous frame are started first, to avoid a slow tile at the end of the frame
+ * leaving the other threads idle. Otherwise, the same partitioning of the tiles to
+ * threads is replayed each frame, to keep each tile's data in the cache of the thread
+ * rendering it
+ */
+struct TileScheduler {
+    glm::uvec2 ntiles = glm::uvec2(0);
+    // The tiles in the order they should be dispatched
+    std::vector<uint32_t> schedule;
+    // The time in ms each tile took to render in the last frame
+    std::vector<float> tile_times;
+    tbb::affinity_partitioner affinity;
+
+    // Setup the schedule for the grid of tiles, traversing them in the order given
+    void initialize(const glm::uvec2 &tiles, const TileOrder order);
+
+    /* Render each tile by calling render_tile(tile_id) in parallel. Each tile's render time
+     * is recorded to schedule the next frame if cost scheduling is used
+     */
+    template <typename F>
+    void parallel_for_tiles(const bool cost_schedule, const F &render_tile);
+
+private:
+    std::vector<uint32_t> spatial_order;
+
+    void sort_by_cost();
+};
+
+// Pick a tile size for the framebuffer which gives each thread several tiles to render
+glm::uvec2 auto_tile_size(const glm::uvec2 &fb_dims);
+
+template <typename F>
+void TileScheduler::parallel_for_tiles(const bool cost_schedule, const F &render_tile)
+{
+    using namespace std::chrono;
+    auto timed_render_tile = [&](const size_t i) {
+        const uint32_t tile_id = schedule[i];
+        const auto start = high_resolution_clock::now();
+        render_tile(tile_id);
+        const auto end = high_resolution_clock::now();
+        tile_times[tile_id] = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+    };
+    auto render_range = [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i = r.begin(); i != r.end(); ++i) {
+            timed_render_tile(i);
+        }
+    };
+
+    if (cost_schedule) {
+        sort_by_cost();
+        // Dispatch the tiles one at a time in order of decreasing cost, so the
+        // expensive tiles are started first
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, schedule.size(), 1),
+                          render_range,
+                          tbb::simple_partitioner());
+    } else {
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, schedule.size()), render_range, affinity);
+    }
+}
@@ -0,0 +1,102 @@
+#include "wavefront.h"
+#include <algorithm>
+
+namespace embree {
+
+RayQueue::RayQueue()
+{
+    resize(0);
+}
+
+void RayQueue::resize(const size_t n)
+{
+    for (auto *b : {&org_x, &org_y, &org_z, &tnear, &dir_x, &dir_y, &dir_z, &time, &tfar}) {
+        b->resize(n);
+    }
+    for (auto *b : {&ng_x, &ng_y, &ng_z, &u, &v}) {
+        b->resize(n);
+    }
+    for (auto *b : {&mask, &id, &flags, &prim_id, &geom_id, &inst_id}) {
+        b->resize(n);
+    }
+
+    stream.ray.org_x = org_x.data();
+    stream.ray.org_y = org_y.data();
+    stream.ray.org_z = org_z.data();
+    stream.ray.tnear = tnear.data();
+    stream.ray.dir_x = dir_x.data();
+    stream.ray.dir_y = dir_y.data();
+    stream.ray.dir_z = dir_z.data();
+    stream.ray.time = time.data();
+    stream.ray.tfar = tfar.data();
+    stream.ray.mask = mask.data();
+    stream.ray.id = id.data();
+    stream.ray.flags = flags.data();
+
+    stream.hit.Ng_x = ng_x.data();
+    stream.hit.Ng_y = ng_y.data();
+    stream.hit.Ng_z = ng_z.data();
+    stream.hit.u = u.data();
+    stream.hit.v = v.data();
+    stream.hit.primID = prim_id.data();
+    stream.hit.geomID = geom_id.data();
+    stream.hit.instID[0] = inst_id.data();
+}
+
+void WavefrontBuffers::resize(const size_t n)
+{
+    if (paths.size() != n) {
+        for (auto *q : {&rays, &next_rays, &light_shadow, &bsdf_shadow}) {
+            q->resize(n);
+        }
+        light_contrib.resize(n);
+        bsdf_contrib.resize(n);
+        paths.resize(n);
+        material_keys.resize(n);
+        shade_order.resize(n);
+    }
+
+    queues.rays = &rays.stream;
+    queues.num_rays = 0;
+    queues.next_rays = &next_rays.stream;
+    queues.num_next_rays = 0;
+    queues.light_shadow = &light_shadow.stream.ray;
+    queues.light_contrib = light_contrib.data();
+    queues.num_light_shadow = 0;
+    queues.bsdf_shadow = &bsdf_shadow.stream.ray;
+    queues.bsdf_contrib = bsdf_contrib.data();
+    queues.num_bsdf_shadow = 0;
+    queues.paths = paths.data();
+    queues.shade_order = nullptr;
+}
+
+void WavefrontBuffers::sort_hits_by_material(const std::vector<ISPCInstance> &instances,
+                                             const size_t num_materials)
+{
+    const RTCRayHitNp *rays = queues.rays;
+    const uint32_t miss_key = num_materials;
+    material_offsets.resize(num_materials + 2);
+    std::fill(material_offsets.begin(), material_offsets.end(), 0);
+
+    for (uint32_t i = 0; i < queues.num_rays; ++i) {
+        const uint32_t inst = rays->hit.instID[0][i];
+        const uint32_t geom = rays->hit.geomID[i];
+        if (inst == RTC_INVALID_GEOMETRY_ID || geom == RTC_INVALID_GEOMETRY_ID) {
+            material_keys[i] = miss_key;
+        } else {
+            material_keys[i] = instances[inst].material_ids[geom];
+        }
+        ++material_offsets[material_keys[i] + 1];
+    }
+
+    for (size_t i = 1; i < material_offsets.size(); ++i) {
+        material_offsets[i] += material_offsets[i - 1];
+    }
+
+    for (uint32_t i = 0; i < queues.num_rays; ++i) {
+        shade_order[material_offsets[material_keys[i]]++] = i;
+    }
+    queues.shade_order = shade_order.data();
+}
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <vector>
+#include <embree3/rtcore.h>
+#include <glm/glm.hpp>
+#include "embree_utils.h"
+
+namespace embree {
+
+// SoA ray and hit buffers which are traced as an Embree ray stream
+struct RayQueue {
+    std::vector<float> org_x, org_y, org_z, tnear;
+    std::vector<float> dir_x, dir_y, dir_z, time;
+    std::vector<float> tfar;
+    std::vector<uint32_t> mask, id, flags;
+
+    std::vector<float> ng_x, ng_y, ng_z;
+    std::vector<float> u, v;
+    std::vector<uint32_t> prim_id, geom_id, inst_id;
+
+    // Pointers to the buffers above, passed to Embree and the ISPC kernels
+    RTCRayHitNp stream;
+
+    RayQueue();
+
+    RayQueue(const RayQueue &) = delete;
+    RayQueue &operator=(const RayQueue &) = delete;
+
+    void resize(const size_t n);
+};
+
+// Mirrors the Sampler in sampler.ih
+struct SamplerState {
+    uint32_t type;
+    uint32_t rng;
+    uint32_t seed;
+    uint32_t sample;
+    uint32_t dimension;
+};
+
+// Mirrors PathAOVs in render_embree.ispc
+struct PathAOVs {
+    float depth;
+    glm::vec3 normal;
+    glm::vec3 albedo;
+    uint32_t instance_id;
+    uint32_t material_id;
+};
+
+struct WavefrontPath {
+    glm::vec3 throughput;
+    SamplerState rng;
+    glm::vec3 illum;
+    uint32_t bounce;
+    PathAOVs aovs;
+};
+
+struct WavefrontQueues {
+    RTCRayHitNp *rays = nullptr;
+    uint32_t num_rays = 0;
+
+    RTCRayHitNp *next_rays = nullptr;
+    uint32_t num_next_rays = 0;
+
+    RTCRayNp *light_shadow = nullptr;
+    glm::vec3 *light_contrib = nullptr;
+    uint32_t num_light_shadow = 0;
+
+    RTCRayNp *bsdf_shadow = nullptr;
+    glm::vec3 *bsdf_contrib = nullptr;
+    uint32_t num_bsdf_shadow = 0;
+
+    WavefrontPath *paths = nullptr;
+
+    // If not null, the order to shade the hits in the ray queue in
+    uint32_t *shade_order = nullptr;
+};
+
+/* The per-thread buffers used by the wavefront integrator to render a tile. The queues
+ * hold a ray for each pixel in the tile and are reused for each tile the thread renders
+ */
+struct WavefrontBuffers {
+    RayQueue rays, next_rays, light_shadow, bsdf_shadow;
+    std::vector<glm::vec3> light_contrib, bsdf_contrib;
+    std::vector<WavefrontPath> paths;
+
+    std::vector<uint32_t> material_keys, shade_order, material_offsets;
+
+    WavefrontQueues queues;
+
+    // Resize the buffers to hold n paths and reset the queues
+    void resize(const size_t n);
+
+    /* Counting sort the hits in the ray queue by the material they hit, so that shading
+     * processes batches of hits with the same material. Misses are placed at the end.
+     * Sets the queue's shade order to the sorted order
+     */
+    void sort_hits_by_material(const std::vector<ISPCInstance> &instances,
+                               const size_t num_materials);
+};
+
+}
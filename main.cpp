@@ -34,7 +34,7 @@
 #include "vulkan/vkdisplay.h"
 #endif
 
-const std::string USAGE =
+const std::string USAGE = std::string(
     "Usage: <backend> <obj_file> [options]\n"
     "Backends:\n"
 #if ENABLE_OSPRAY
@@ -59,8 +59,16 @@ const std::string USAGE =
     "\t-fov <fovy>            Specify the camera field of view (in degrees)\n"
     "\t-camera <n>            If the scene contains multiple cameras, specify which\n"
     "\t                       should be used. Defaults to the first camera\n"
+    "\t-scene-cache           Load the scene from a binary cache written next to the\n"
+    "\t                       scene file on the first load, skipping parsing it\n"
     "\t-img <x> <y>           Specify the window dimensions. Defaults to 1280x720\n"
-    "\n";
+    "\t-max-depth <n>         Maximum number of bounces per path. Defaults to 5\n"
+    "\t-rr-depth <n>          Number of bounces before paths can be terminated by Russian\n"
+    "\t                       roulette. Defaults to no roulette\n")
+#if ENABLE_EMBREE
+    + embree_option_usage()
+#endif
+    + "\n";
 
 int win_width = 1280;
 int win_height = 720;
@@ -72,6 +80,41 @@ glm::vec2 transform_mouse(glm::vec2 in)
     return glm::vec2(in.x * 2.f / win_width - 1.f, 1.f - 2.f * in.y / win_height);
 }
 
+// Show a slider for a material parameter, or note that it's textured. Returns true if changed
+bool material_param_slider(const char *label, float &val, const float max_val = 1.f)
+{
+    const uint32_t handle = *reinterpret_cast<const uint32_t *>(&val);
+    if (IS_TEXTURED_PARAM(handle)) {
+        ImGui::Text("%s: texture %u", label, GET_TEXTURE_ID(handle));
+        return false;
+    }
+    return ImGui::SliderFloat(label, &val, 0.f, max_val);
+}
+
+// Show the editor for the material's parameters. Returns true if the material was changed
+bool material_editor(DisneyMaterial &mat)
+{
+    bool changed = false;
+    const uint32_t color_handle = *reinterpret_cast<const uint32_t *>(&mat.base_color.x);
+    if (IS_TEXTURED_PARAM(color_handle)) {
+        ImGui::Text("Base Color: texture %u", GET_TEXTURE_ID(color_handle));
+    } else {
+        changed |= ImGui::ColorEdit3("Base Color", &mat.base_color.x);
+    }
+    changed |= material_param_slider("Metallic", mat.metallic);
+    changed |= material_param_slider("Specular", mat.specular);
+    changed |= material_param_slider("Roughness", mat.roughness);
+    changed |= material_param_slider("Specular Tint", mat.specular_tint);
+    changed |= material_param_slider("Anisotropy", mat.anisotropy);
+    changed |= material_param_slider("Sheen", mat.sheen);
+    changed |= material_param_slider("Sheen Tint", mat.sheen_tint);
+    changed |= material_param_slider("Clearcoat", mat.clearcoat);
+    changed |= material_param_slider("Clearcoat Gloss", mat.clearcoat_gloss);
+    changed |= material_param_slider("IOR", mat.ior, 3.f);
+    changed |= material_param_slider("Transmission", mat.specular_transmission);
+    return changed;
+}
+
 int main(int argc, const char **argv)
 {
     const std::vector<std::string> args(argv, argv + argc);
@@ -186,8 +229,14 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
     glm::vec3 up(0, 1, 0);
     float fov_y = 65.f;
     size_t camera_id = 0;
+    bool use_scene_cache = false;
     std::string backend_arg;
     std::string validation_img_prefix;
+    PathParams path_params;
+    bool got_path_params = false;
+#if ENABLE_EMBREE
+    EmbreeOptions embree_options;
+#endif
     for (size_t i = 1; i < args.size(); ++i) {
         if (args[i] == "-eye") {
             eye.x = std::stof(args[++i]);
@@ -209,8 +258,16 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
             got_camera_args = true;
         } else if (args[i] == "-camera") {
             camera_id = std::stol(args[++i]);
+        } else if (args[i] == "-scene-cache") {
+            use_scene_cache = true;
         } else if (args[i] == "-validation") {
             validation_img_prefix = args[++i];
+        } else if (args[i] == "-max-depth") {
+            path_params.max_depth = std::max(std::stoi(args[++i]), 1);
+            got_path_params = true;
+        } else if (args[i] == "-rr-depth") {
+            path_params.roulette_min_depth = std::max(std::stoi(args[++i]), 0);
+            got_path_params = true;
         }
 #if ENABLE_OSPRAY
         else if (args[i] == "-ospray") {
@@ -227,8 +284,9 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
 #endif
 #if ENABLE_EMBREE
         else if (args[i] == "-embree") {
-            renderer = std::make_unique<RenderEmbree>();
+            // The renderer is created after parsing so it gets any Embree options
             backend_arg = args[i];
+        } else if (parse_embree_option(embree_options, args, i)) {
         }
 #endif
 #if ENABLE_DXR
@@ -261,6 +319,11 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
             canonicalize_path(scene_file);
         }
     }
+#if ENABLE_EMBREE
+    if (backend_arg == "-embree") {
+        renderer = std::make_unique<RenderEmbree>(embree_options);
+    }
+#endif
     if (!renderer) {
         std::cout << "Error: No renderer backend or invalid backend name specified\n" << USAGE;
         std::exit(1);
@@ -271,11 +334,16 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
     }
 
     display->resize(win_width, win_height);
+    if (got_path_params) {
+        renderer->set_path_params(path_params);
+    }
     renderer->initialize(win_width, win_height);
 
     std::string scene_info;
+    // A copy of the scene's materials, edited through the material editor
+    std::vector<DisneyMaterial> materials;
     {
-        Scene scene(scene_file);
+        Scene scene(scene_file, use_scene_cache);
 
         std::stringstream ss;
         ss << "Scene '" << scene_file << "':\n"
@@ -293,6 +361,10 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
         std::cout << scene_info << "\n";
 
         renderer->set_scene(scene);
+        materials = scene.materials;
+        for (const auto &stage : renderer->set_scene_stage_times) {
+            std::cout << "set_scene " << stage.first << ": " << stage.second << "ms\n";
+        }
 
         if (!got_camera_args && !scene.cameras.empty()) {
             eye = scene.cameras[camera_id].position;
@@ -309,6 +381,9 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
     const std::string gpu_brand = display->gpu_brand();
     const std::string image_output = "chameleonrt.png";
     const std::string display_frontend = display->name();
+    // Updating no materials tells us if the backend supports updating them
+    const bool can_edit_materials = renderer->update_materials({}, {});
+    int edit_material_id = 0;
 
     size_t frame_id = 0;
     float render_time = 0.f;
@@ -435,6 +510,12 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
             const std::string rays_per_sec = pretty_print_count(rays_per_second / frame_id);
             ImGui::Text("Rays per-second: %sRay/s", rays_per_sec.c_str());
         }
+        if (stats.lane_occupancy >= 0) {
+            ImGui::Text("SIMD Lane Occupancy: %.1f%%", 100.f * stats.lane_occupancy);
+        }
+        if (stats.converged) {
+            ImGui::Text("Image Converged");
+        }
 
         ImGui::Text("Total Application Time: %.3f ms/frame (%.1f FPS)",
                     1000.0f / ImGui::GetIO().Framerate,
@@ -451,6 +532,23 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
         }
 
         ImGui::End();
+
+        if (!materials.empty()) {
+            ImGui::Begin("Material Editor");
+            if (can_edit_materials) {
+                ImGui::SliderInt("Material", &edit_material_id, 0, materials.size() - 1);
+                edit_material_id = glm::clamp(edit_material_id, 0, int(materials.size()) - 1);
+                DisneyMaterial &mat = materials[edit_material_id];
+                if (material_editor(mat)) {
+                    renderer->update_materials({uint32_t(edit_material_id)}, {mat});
+                    frame_id = 0;
+                }
+            } else {
+                ImGui::Text("%s doesn't support updating materials", rt_backend.c_str());
+            }
+            ImGui::End();
+        }
+
         ImGui::Render();
 
         if (display_is_native) {
@@ -127,23 +127,23 @@ void RenderOptiX::set_scene(const Scene &scene)
         for (const auto &geom : mesh.geometries) {
             auto vertices =
                 std::make_shared<optix::Buffer>(geom.vertices.size() * sizeof(glm::vec3));
-            vertices->upload(geom.vertices);
+            vertices->upload(geom.vertices.data(), geom.vertices.size() * sizeof(glm::vec3));
 
             auto indices =
                 std::make_shared<optix::Buffer>(geom.indices.size() * sizeof(glm::uvec3));
-            indices->upload(geom.indices);
+            indices->upload(geom.indices.data(), geom.indices.size() * sizeof(glm::uvec3));
 
             std::shared_ptr<optix::Buffer> uvs = nullptr;
             if (!geom.uvs.empty()) {
                 uvs = std::make_shared<optix::Buffer>(geom.uvs.size() * sizeof(glm::vec2));
-                uvs->upload(geom.uvs);
+                uvs->upload(geom.uvs.data(), geom.uvs.size() * sizeof(glm::vec2));
             }
 
             std::shared_ptr<optix::Buffer> normals = nullptr;
             if (!geom.normals.empty()) {
                 normals =
                     std::make_shared<optix::Buffer>(geom.normals.size() * sizeof(glm::vec3));
-                normals->upload(geom.normals);
+                normals->upload(geom.normals.data(), geom.normals.size() * sizeof(glm::vec3));
             }
 
             geometries.emplace_back(
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <limits>
 #include <numeric>
+#include <stdexcept>
 #include <tbb/parallel_for.h>
 #include "texture_channel_mask.h"
 #include "util.h"
@@ -85,11 +86,13 @@ void RenderOSPRay::set_scene(const Scene &in_scene)
         }
         img.color_space = LINEAR;
         const int convert_channels = std::min(3, img.channels);
+        // Get the image data before the loop, to copy it once if it references a mapped file
+        uint8_t *data = img.img.data();
         tbb::parallel_for(size_t(0), size_t(img.width) * img.height, [&](size_t px) {
             for (int c = 0; c < convert_channels; ++c) {
-                float x = img.img[px * img.channels + c] / 255.f;
+                float x = data[px * img.channels + c] / 255.f;
                 x = srgb_to_linear(x);
-                img.img[px * img.channels + c] = glm::clamp(x * 255.f, 0.f, 255.f);
+                data[px * img.channels + c] = glm::clamp(x * 255.f, 0.f, 255.f);
             }
         });
     });
@@ -119,28 +122,7 @@ void RenderOSPRay::set_scene(const Scene &in_scene)
     materials.clear();
     for (const auto &mat : scene.materials) {
         OSPMaterial m = ospNewMaterial("pathtracer", "principled");
-        const int tex_handle = *reinterpret_cast<const int *>(&mat.base_color.x);
-        if (IS_TEXTURED_PARAM(tex_handle)) {
-            ospSetParam(
-                m, "map_baseColor", OSP_TEXTURE, &textures[GET_TEXTURE_ID(tex_handle)]);
-        } else {
-            ospSetParam(m, "baseColor", OSP_VEC3F, &mat.base_color.x);
-        }
-
-        set_material_param(m, "metallic", mat.metallic);
-        // TODO: Seems like "specular" here means something really different and weird or is
-        // buggy
-        // set_material_param(m, "specular", mat.specular);
-        set_material_param(m, "roughness", mat.roughness);
-        // TODO: name for "specularTint" in OSPRay's model?
-        set_material_param(m, "anisotropy", mat.anisotropy);
-        set_material_param(m, "sheen", mat.sheen);
-        set_material_param(m, "sheenTint", mat.sheen_tint);
-        set_material_param(m, "coat", mat.clearcoat);
-        // TODO: need to map clearcoat gloss to ospray
-        set_material_param(m, "ior", mat.ior);
-        set_material_param(m, "transmission", mat.specular_transmission);
-
+        set_material(m, mat);
         ospCommit(m);
         materials.push_back(m);
     }
@@ -261,14 +243,91 @@ void RenderOSPRay::set_scene(const Scene &in_scene)
     ospCommit(world);
 }
 
+bool RenderOSPRay::update_instances(const std::vector<uint32_t> &ids,
+                                    const std::vector<glm::mat4> &transforms)
+{
+    if (ids.size() != transforms.size()) {
+        throw std::runtime_error("update_instances: mismatched number of ids and transforms");
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (ids[i] >= scene.instances.size()) {
+            throw std::runtime_error("update_instances: invalid instance id " +
+                                     std::to_string(ids[i]));
+        }
+        scene.instances[ids[i]].transform = transforms[i];
+        const glm::mat4x3 m(transforms[i]);
+        ospSetParam(instances[ids[i]], "xfm", OSP_AFFINE3F, glm::value_ptr(m));
+        ospCommit(instances[ids[i]]);
+    }
+    // Recommitting the world rebuilds its BVH over the instances, the groups are unchanged
+    ospCommit(world);
+    ospResetAccumulation(fb);
+    return true;
+}
+
+bool RenderOSPRay::update_materials(const std::vector<uint32_t> &ids,
+                                    const std::vector<DisneyMaterial> &new_materials)
+{
+    if (ids.size() != new_materials.size()) {
+        throw std::runtime_error("update_materials: mismatched number of ids and materials");
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (ids[i] >= materials.size()) {
+            throw std::runtime_error("update_materials: invalid material id " +
+                                     std::to_string(ids[i]));
+        }
+        scene.materials[ids[i]] = new_materials[i];
+        set_material(materials[ids[i]], new_materials[i]);
+        ospCommit(materials[ids[i]]);
+    }
+    // The renderer holds the material list, the world and its BVHs are unchanged
+    ospCommit(renderer);
+    ospResetAccumulation(fb);
+    return true;
+}
+
+void RenderOSPRay::set_path_params(const PathParams &params)
+{
+    path_params = params;
+
+    const int max_path_length = params.max_depth;
+    const int roulette_path_length = std::min(params.roulette_min_depth, params.max_depth);
+    ospSetParam(renderer, "maxPathLength", OSP_INT, &max_path_length);
+    ospSetParam(renderer, "roulettePathLength", OSP_INT, &roulette_path_length);
+    ospCommit(renderer);
+    if (fb) {
+        ospResetAccumulation(fb);
+    }
+}
+
 RenderStats RenderOSPRay::render(const glm::vec3 &pos,
                                  const glm::vec3 &dir,
                                  const glm::vec3 &up,
                                  const float fovy,
                                  const bool camera_changed,
                                  const bool need_readback)
+{
+    return render_samples(pos, dir, up, fovy, camera_changed, need_readback, 1);
+}
+
+RenderStats RenderOSPRay::render_samples(const glm::vec3 &pos,
+                                         const glm::vec3 &dir,
+                                         const glm::vec3 &up,
+                                         const float fovy,
+                                         const bool camera_changed,
+                                         const bool need_readback,
+                                         const uint32_t samples_per_call)
 {
     using namespace std::chrono;
+    // OSPRay weights each frame equally when accumulating, so changing the number of
+    // samples taken per-frame requires restarting accumulation
+    if (pixel_samples != int(samples_per_call)) {
+        pixel_samples = samples_per_call;
+        ospSetParam(renderer, "pixelSamples", OSP_INT, &pixel_samples);
+        ospCommit(renderer);
+        ospResetAccumulation(fb);
+    }
+
     if (camera_changed) {
         ospSetParam(camera, "position", OSP_VEC3F, &pos.x);
         ospSetParam(camera, "direction", OSP_VEC3F, &dir.x);
@@ -293,15 +352,42 @@ RenderStats RenderOSPRay::render(const glm::vec3 &pos,
     return stats;
 }
 
+void RenderOSPRay::set_material(OSPMaterial &m, const DisneyMaterial &mat) const
+{
+    const int tex_handle = *reinterpret_cast<const int *>(&mat.base_color.x);
+    if (IS_TEXTURED_PARAM(tex_handle)) {
+        ospSetParam(m, "map_baseColor", OSP_TEXTURE, &textures[GET_TEXTURE_ID(tex_handle)]);
+    } else {
+        ospRemoveParam(m, "map_baseColor");
+        ospSetParam(m, "baseColor", OSP_VEC3F, &mat.base_color.x);
+    }
+
+    set_material_param(m, "metallic", mat.metallic);
+    // TODO: Seems like "specular" here means something really different and weird or is
+    // buggy
+    // set_material_param(m, "specular", mat.specular);
+    set_material_param(m, "roughness", mat.roughness);
+    // TODO: name for "specularTint" in OSPRay's model?
+    set_material_param(m, "anisotropy", mat.anisotropy);
+    set_material_param(m, "sheen", mat.sheen);
+    set_material_param(m, "sheenTint", mat.sheen_tint);
+    set_material_param(m, "coat", mat.clearcoat);
+    // TODO: need to map clearcoat gloss to ospray
+    set_material_param(m, "ior", mat.ior);
+    set_material_param(m, "transmission", mat.specular_transmission);
+}
+
 void RenderOSPRay::set_material_param(OSPMaterial &mat,
                                       const std::string &name,
                                       const float val) const
 {
     const uint32_t handle = *reinterpret_cast<const uint32_t *>(&val);
+    const std::string map_name = "map_" + name;
     if (IS_TEXTURED_PARAM(handle)) {
-        const std::string map_name = "map_" + name;
         ospSetParam(mat, map_name.c_str(), OSP_TEXTURE, &textures[GET_TEXTURE_ID(handle)]);
     } else {
+        // Remove any texture previously set on the material by update_materials
+        ospRemoveParam(mat, map_name.c_str());
         ospSetParam(mat, name.c_str(), OSP_FLOAT, &val);
     }
 }
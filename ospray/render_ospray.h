@@ -15,6 +15,7 @@ struct RenderOSPRay : RenderBackend {
     std::vector<OSPMaterial> materials;
     std::vector<OSPInstance> instances;
     std::vector<OSPLight> lights;
+    int pixel_samples = 1;
 
     RenderOSPRay();
     ~RenderOSPRay();
@@ -22,13 +23,26 @@ struct RenderOSPRay : RenderBackend {
     std::string name() override;
     void initialize(const int fb_width, const int fb_height) override;
     void set_scene(const Scene &scene) override;
+    void set_path_params(const PathParams &params) override;
+    bool update_instances(const std::vector<uint32_t> &ids,
+                          const std::vector<glm::mat4> &transforms) override;
+    bool update_materials(const std::vector<uint32_t> &ids,
+                          const std::vector<DisneyMaterial> &new_materials) override;
     RenderStats render(const glm::vec3 &pos,
                        const glm::vec3 &dir,
                        const glm::vec3 &up,
                        const float fovy,
                        const bool camera_changed,
                        const bool need_readback) override;
+    RenderStats render_samples(const glm::vec3 &pos,
+                               const glm::vec3 &dir,
+                               const glm::vec3 &up,
+                               const float fovy,
+                               const bool camera_changed,
+                               const bool need_readback,
+                               const uint32_t samples_per_call) override;
 
 private:
+    void set_material(OSPMaterial &m, const DisneyMaterial &mat) const;
     void set_material_param(OSPMaterial &mat, const std::string &name, const float val) const;
 };
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+/* An array which either owns its data in a std::vector or references data owned by another
+ * object, e.g., a FileMapping, which is kept alive by the shared_ptr to it. This lets data
+ * loaded from mapped files be used without copying it, while still supporting the vector
+ * operations used to build arrays when loading other formats. Referenced data is read-only,
+ * calling any non-const method on a referencing array first copies the data into the vector
+ */
+template <typename T>
+class MappedArray {
+    std::vector<T> owned;
+    std::shared_ptr<const void> owner;
+    const T *mapped = nullptr;
+    size_t mapped_count = 0;
+
+    // Copy referenced data into the vector, so it can be modified
+    void make_owned()
+    {
+        if (mapped) {
+            owned = std::vector<T>(mapped, mapped + mapped_count);
+            owner = nullptr;
+            mapped = nullptr;
+            mapped_count = 0;
+        }
+    }
+
+public:
+    using value_type = T;
+
+    MappedArray() = default;
+
+    MappedArray(const std::vector<T> &vec) : owned(vec) {}
+
+    MappedArray(std::vector<T> &&vec) : owned(std::move(vec)) {}
+
+    // Reference count elements starting at data, which are kept alive by owner
+    MappedArray(std::shared_ptr<const void> owner, const T *data, const size_t count)
+        : owner(owner), mapped(data), mapped_count(count)
+    {
+    }
+
+    // Returns true if the array references data owned by another object
+    bool is_mapped() const
+    {
+        return mapped != nullptr;
+    }
+
+    size_t size() const
+    {
+        return mapped ? mapped_count : owned.size();
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    const T *data() const
+    {
+        return mapped ? mapped : owned.data();
+    }
+
+    T *data()
+    {
+        make_owned();
+        return owned.data();
+    }
+
+    const T &operator[](const size_t i) const
+    {
+        return data()[i];
+    }
+
+    T &operator[](const size_t i)
+    {
+        make_owned();
+        return owned[i];
+    }
+
+    const T *begin() const
+    {
+        return data();
+    }
+
+    const T *end() const
+    {
+        return data() + size();
+    }
+
+    T *begin()
+    {
+        return data();
+    }
+
+    T *end()
+    {
+        return data() + size();
+    }
+
+    void push_back(const T &val)
+    {
+        make_owned();
+        owned.push_back(val);
+    }
+
+    template <typename... Args>
+    void emplace_back(Args &&... args)
+    {
+        make_owned();
+        owned.emplace_back(std::forward<Args>(args)...);
+    }
+
+    void reserve(const size_t n)
+    {
+        make_owned();
+        owned.reserve(n);
+    }
+
+    void resize(const size_t n)
+    {
+        make_owned();
+        owned.resize(n);
+    }
+
+    void clear()
+    {
+        owned.clear();
+        owner = nullptr;
+        mapped = nullptr;
+        mapped_count = 0;
+    }
+};
@@ -26,8 +26,19 @@ Image::Image(const uint8_t *buf,
       width(width),
       height(height),
       channels(channels),
-      img(buf, buf + width * height * channels),
+      img(std::vector<uint8_t>(buf, buf + width * height * channels)),
       color_space(color_space)
 {
 }
 
+HDRImage::HDRImage(const std::string &file) : name(file)
+{
+    int channels = 0;
+    float *data = stbi_loadf(file.c_str(), &width, &height, &channels, 3);
+    if (!data) {
+        throw std::runtime_error("Failed to load " + file);
+    }
+    img = std::vector<float>(data, data + size_t(width) * height * 3);
+    stbi_image_free(data);
+}
+
@@ -3,6 +3,7 @@
 #include <memory>
 #include <string>
 #include <vector>
+#include "mapped_array.h"
 #include "texture_channel_mask.h"
 #include <glm/glm.hpp>
 
@@ -13,7 +14,7 @@ struct Image {
     int width = -1;
     int height = -1;
     int channels = -1;
-    std::vector<uint8_t> img;
+    MappedArray<uint8_t> img;
     ColorSpace color_space = LINEAR;
 
     Image(const std::string &file, const std::string &name, ColorSpace color_space = LINEAR);
@@ -26,6 +27,17 @@ struct Image {
     Image() = default;
 };
 
+// A floating point RGB image, e.g. an HDR environment map
+struct HDRImage {
+    std::string name;
+    int width = -1;
+    int height = -1;
+    std::vector<float> img;
+
+    HDRImage(const std::string &file);
+    HDRImage() = default;
+};
+
 struct DisneyMaterial {
     glm::vec3 base_color = glm::vec3(0.9f);
     float metallic = 0;
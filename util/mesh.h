@@ -1,12 +1,14 @@
 #pragma once
 
 #include <vector>
+#include "mapped_array.h"
 #include <glm/glm.hpp>
 
 struct Geometry {
-    std::vector<glm::vec3> vertices, normals;
-    std::vector<glm::vec2> uvs;
-    std::vector<glm::uvec3> indices;
+    // The arrays can reference data in the mapped scene file, e.g., when loading CRTS files
+    MappedArray<glm::vec3> vertices, normals;
+    MappedArray<glm::vec2> uvs;
+    MappedArray<glm::uvec3> indices;
 
     size_t num_tris() const;
 };
@@ -0,0 +1,777 @@
+#include "obj_loader.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include "file_mapping.h"
+
+namespace {
+
+// The file is split into chunks of at least this many bytes to be parsed in parallel
+const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+size_t num_hardware_threads()
+{
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// Call f(i) for each i in [0, n) on the hardware threads, rethrowing the first exception
+template <typename F>
+void parallel_for(const size_t n, const F &f)
+{
+    std::atomic<size_t> next(0);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(n, num_hardware_threads()); ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+        t.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+bool is_digit(const char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+bool is_space(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+const char *skip_space(const char *p, const char *end)
+{
+    while (p != end && is_space(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+const char *skip_token(const char *p, const char *end)
+{
+    while (p != end && !is_space(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+// Get the rest of the line with leading and trailing whitespace removed
+std::string parse_name(const char *p, const char *end)
+{
+    p = skip_space(p, end);
+    while (end != p && is_space(*(end - 1))) {
+        --end;
+    }
+    return std::string(p, end);
+}
+
+/* Parse the number in [s, end) using the same arithmetic as tinyobjloader's tryParseDouble,
+ * so the loaded values match those it would load exactly. Returns false if s isn't a number
+ */
+bool parse_double(const char *s, const char *end, double &result)
+{
+    static const double pow_lut[] = {
+        1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001};
+    const int lut_entries = sizeof(pow_lut) / sizeof(pow_lut[0]);
+
+    if (s == end) {
+        return false;
+    }
+    const char sign = *s;
+    if (sign == '+' || sign == '-') {
+        ++s;
+    } else if (!is_digit(sign)) {
+        return false;
+    }
+
+    double mantissa = 0.0;
+    int read = 0;
+    for (; s != end && is_digit(*s); ++s, ++read) {
+        mantissa *= 10;
+        mantissa += static_cast<int>(*s - '0');
+    }
+    if (read == 0) {
+        return false;
+    }
+
+    if (s != end && *s == '.') {
+        ++s;
+        for (read = 1; s != end && is_digit(*s); ++s, ++read) {
+            mantissa += static_cast<int>(*s - '0') *
+                        (read < lut_entries ? pow_lut[read] : std::pow(10.0, -read));
+        }
+    }
+
+    int exponent = 0;
+    if (s != end && (*s == 'e' || *s == 'E')) {
+        ++s;
+        char exp_sign = '+';
+        if (s != end && (*s == '+' || *s == '-')) {
+            exp_sign = *s;
+            ++s;
+        }
+        for (read = 0; s != end && is_digit(*s); ++s, ++read) {
+            exponent *= 10;
+            exponent += static_cast<int>(*s - '0');
+        }
+        if (read == 0) {
+            return false;
+        }
+        exponent *= exp_sign == '+' ? 1 : -1;
+    }
+
+    result = (sign == '-' ? -1 : 1) *
+             (exponent ? std::ldexp(mantissa * std::pow(5.0, exponent), exponent) : mantissa);
+    return true;
+}
+
+// Parse the next whitespace separated float on the line, or 0 if it's missing or invalid
+float parse_float(const char *&p, const char *end)
+{
+    p = skip_space(p, end);
+    const char *token_end = skip_token(p, end);
+    double val = 0.0;
+    parse_double(p, token_end, val);
+    p = token_end;
+    return static_cast<float>(val);
+}
+
+int parse_int(const char *&p, const char *end)
+{
+    bool negative = false;
+    if (p != end && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        ++p;
+    }
+    int val = 0;
+    for (; p != end && is_digit(*p); ++p) {
+        val = val * 10 + (*p - '0');
+    }
+    return negative ? -val : val;
+}
+
+enum RelativeIndexFlags { RELATIVE_VERTEX = 1, RELATIVE_NORMAL = 2, RELATIVE_TEXCOORD = 4 };
+
+/* The 0-based vertex, normal and texcoord indices of a face vertex, or -1 if the face
+ * doesn't reference a normal or texcoord. Relative (negative) indices are stored relative
+ * to the start of the chunk and flagged, until the offset of the chunk is known
+ */
+struct OBJIndex {
+    int32_t vertex = -1;
+    int32_t normal = -1;
+    int32_t texcoord = -1;
+    uint32_t relative = 0;
+};
+
+struct OBJCommand {
+    enum Type { GROUP, USEMTL, MTLLIB };
+
+    Type type;
+    std::string name;
+    // The number of faces in the chunk before the command
+    size_t face;
+    // The number of triangles in the chunk before the command, set once the chunk's faces
+    // have been triangulated
+    size_t triangle;
+};
+
+struct OBJChunk {
+    std::vector<float> vertices;
+    std::vector<float> normals;
+    std::vector<float> texcoords;
+    /* The vertex indices of each face in the chunk. Until the faces are triangulated, if
+     * the chunk contains any polygons the number of vertices in each face is stored in
+     * face_sizes, otherwise all faces are triangles
+     */
+    std::vector<OBJIndex> indices;
+    std::vector<uint32_t> face_sizes;
+    // The group, object and material commands in the chunk, which apply to the faces
+    // following them
+    std::vector<OBJCommand> commands;
+    bool has_relative_indices = false;
+
+    size_t num_faces() const
+    {
+        return face_sizes.empty() ? indices.size() / 3 : face_sizes.size();
+    }
+
+    size_t num_triangles() const
+    {
+        return indices.size() / 3;
+    }
+};
+
+// Convert the 1-based or relative OBJ index to 0-based, returns false if the index is 0
+bool fix_index(
+    const int idx, const size_t count, const uint32_t flag, OBJIndex &out, int32_t &ret)
+{
+    if (idx > 0) {
+        ret = idx - 1;
+        return true;
+    }
+    if (idx < 0) {
+        ret = int32_t(count) + idx;
+        out.relative |= flag;
+        return true;
+    }
+    return false;
+}
+
+// Parse a face vertex: v, v/vt, v//vn or v/vt/vn
+bool parse_face_vertex(const char *&p, const char *end, const OBJChunk &chunk, OBJIndex &idx)
+{
+    auto skip_index = [&]() {
+        while (p != end && *p != '/' && !is_space(*p)) {
+            ++p;
+        }
+    };
+
+    if (!fix_index(
+            parse_int(p, end), chunk.vertices.size() / 3, RELATIVE_VERTEX, idx, idx.vertex)) {
+        return false;
+    }
+    skip_index();
+    if (p == end || *p != '/') {
+        return true;
+    }
+    ++p;
+
+    if (p == end || *p != '/') {
+        if (!fix_index(parse_int(p, end),
+                       chunk.texcoords.size() / 2,
+                       RELATIVE_TEXCOORD,
+                       idx,
+                       idx.texcoord)) {
+            return false;
+        }
+        skip_index();
+        if (p == end || *p != '/') {
+            return true;
+        }
+    }
+    ++p;
+    return fix_index(
+        parse_int(p, end), chunk.normals.size() / 3, RELATIVE_NORMAL, idx, idx.normal);
+}
+
+void parse_chunk(const char *p, const char *end, OBJChunk &chunk)
+{
+    std::vector<OBJIndex> face;
+    while (p != end) {
+        const char *line_end = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        if (!line_end) {
+            line_end = end;
+        }
+        const char *next_line = line_end == end ? end : line_end + 1;
+
+        p = skip_space(p, line_end);
+        const char *args = skip_token(p, line_end);
+        const std::string keyword(p, args);
+        p = next_line;
+
+        if (keyword == "v") {
+            for (size_t i = 0; i < 3; ++i) {
+                chunk.vertices.push_back(parse_float(args, line_end));
+            }
+        } else if (keyword == "vn") {
+            for (size_t i = 0; i < 3; ++i) {
+                chunk.normals.push_back(parse_float(args, line_end));
+            }
+        } else if (keyword == "vt") {
+            for (size_t i = 0; i < 2; ++i) {
+                chunk.texcoords.push_back(parse_float(args, line_end));
+            }
+        } else if (keyword == "f") {
+            face.clear();
+            for (args = skip_space(args, line_end); args != line_end;
+                 args = skip_space(skip_token(args, line_end), line_end)) {
+                OBJIndex idx;
+                if (!parse_face_vertex(args, line_end, chunk, idx)) {
+                    throw std::runtime_error("Invalid face index 0 in OBJ face");
+                }
+                chunk.has_relative_indices |= idx.relative != 0;
+                face.push_back(idx);
+            }
+            // Faces with fewer than 3 vertices are skipped. Polygons are triangulated once
+            // all vertices have been loaded, since they may use vertices from other chunks
+            if (face.size() < 3) {
+                continue;
+            }
+            if (face.size() > 3 && chunk.face_sizes.empty()) {
+                chunk.face_sizes.resize(chunk.indices.size() / 3, 3);
+            }
+            if (face.size() > 3 || !chunk.face_sizes.empty()) {
+                chunk.face_sizes.push_back(face.size());
+            }
+            chunk.indices.insert(chunk.indices.end(), face.begin(), face.end());
+        } else if (keyword == "g" || keyword == "o") {
+            chunk.commands.push_back(OBJCommand{
+                OBJCommand::GROUP, parse_name(args, line_end), chunk.num_faces(), 0});
+        } else if (keyword == "usemtl") {
+            chunk.commands.push_back(OBJCommand{
+                OBJCommand::USEMTL, parse_name(args, line_end), chunk.num_faces(), 0});
+        } else if (keyword == "mtllib") {
+            chunk.commands.push_back(OBJCommand{
+                OBJCommand::MTLLIB, parse_name(args, line_end), chunk.num_faces(), 0});
+        }
+    }
+}
+
+// Test if the point is inside the polygon, from tinyobjloader
+int pnpoly(int nvert, const float *vertx, const float *verty, float testx, float testy)
+{
+    int i, j, c = 0;
+    for (i = 0, j = nvert - 1; i < nvert; j = i++) {
+        if (((verty[i] > testy) != (verty[j] > testy)) &&
+            (testx <
+             (vertx[j] - vertx[i]) * (testy - verty[i]) / (verty[j] - verty[i]) + vertx[i])) {
+            c = !c;
+        }
+    }
+    return c;
+}
+
+/* Triangulate the face by ear clipping, ported from tinyobjloader's exportGroupsToShape so
+ * that polygons are split into the same triangles as tinyobjloader would produce. The
+ * polygon is projected onto the two axes with the largest extent of its first corner's
+ * normal, and ears are clipped in the polygon's winding order. Ears are skipped if the
+ * corner is reflex or another vertex of the polygon lies inside them. If no ear can be found
+ * the remaining vertices are dropped, as in tinyobjloader
+ */
+void triangulate_face(const OBJIndex *face,
+                      const size_t num_verts,
+                      const std::vector<float> &v,
+                      std::vector<OBJIndex> &out)
+{
+    if (num_verts == 3) {
+        out.insert(out.end(), face, face + 3);
+        return;
+    }
+
+    // Find the two axes to work in
+    size_t npolys = num_verts;
+    size_t axes[2] = {1, 2};
+    for (size_t k = 0; k < npolys; ++k) {
+        const size_t vi0 = size_t(face[k % npolys].vertex);
+        const size_t vi1 = size_t(face[(k + 1) % npolys].vertex);
+        const size_t vi2 = size_t(face[(k + 2) % npolys].vertex);
+        if (3 * vi0 + 2 >= v.size() || 3 * vi1 + 2 >= v.size() || 3 * vi2 + 2 >= v.size()) {
+            continue;
+        }
+        const float e0x = v[vi1 * 3] - v[vi0 * 3];
+        const float e0y = v[vi1 * 3 + 1] - v[vi0 * 3 + 1];
+        const float e0z = v[vi1 * 3 + 2] - v[vi0 * 3 + 2];
+        const float e1x = v[vi2 * 3] - v[vi1 * 3];
+        const float e1y = v[vi2 * 3 + 1] - v[vi1 * 3 + 1];
+        const float e1z = v[vi2 * 3 + 2] - v[vi1 * 3 + 2];
+        const float cx = std::fabs(e0y * e1z - e0z * e1y);
+        const float cy = std::fabs(e0z * e1x - e0x * e1z);
+        const float cz = std::fabs(e0x * e1y - e0y * e1x);
+        const float epsilon = std::numeric_limits<float>::epsilon();
+        if (cx > epsilon || cy > epsilon || cz > epsilon) {
+            if (!(cx > cy && cx > cz)) {
+                axes[0] = 0;
+                if (cz > cx && cz > cy) {
+                    axes[1] = 1;
+                }
+            }
+            break;
+        }
+    }
+
+    float area = 0;
+    for (size_t k = 0; k < npolys; ++k) {
+        const size_t vi0 = size_t(face[k].vertex);
+        const size_t vi1 = size_t(face[(k + 1) % npolys].vertex);
+        if (vi0 * 3 + axes[0] >= v.size() || vi0 * 3 + axes[1] >= v.size() ||
+            vi1 * 3 + axes[0] >= v.size() || vi1 * 3 + axes[1] >= v.size()) {
+            continue;
+        }
+        const float v0x = v[vi0 * 3 + axes[0]];
+        const float v0y = v[vi0 * 3 + axes[1]];
+        const float v1x = v[vi1 * 3 + axes[0]];
+        const float v1y = v[vi1 * 3 + axes[1]];
+        area += (v0x * v1y - v0y * v1x) * 0.5f;
+    }
+
+    std::vector<OBJIndex> remaining(face, face + num_verts);
+    size_t guess_vert = 0;
+    OBJIndex ind[3];
+    float vx[3];
+    float vy[3];
+    // How many iterations we can do without decreasing the remaining vertices
+    size_t remaining_iterations = remaining.size();
+    size_t previous_remaining_verts = remaining.size();
+    while (remaining.size() > 3 && remaining_iterations > 0) {
+        npolys = remaining.size();
+        if (guess_vert >= npolys) {
+            guess_vert -= npolys;
+        }
+
+        if (previous_remaining_verts != npolys) {
+            previous_remaining_verts = npolys;
+            remaining_iterations = npolys;
+        } else {
+            --remaining_iterations;
+        }
+
+        for (size_t k = 0; k < 3; ++k) {
+            ind[k] = remaining[(guess_vert + k) % npolys];
+            const size_t vi = size_t(ind[k].vertex);
+            if (vi * 3 + axes[0] >= v.size() || vi * 3 + axes[1] >= v.size()) {
+                vx[k] = 0.f;
+                vy[k] = 0.f;
+            } else {
+                vx[k] = v[vi * 3 + axes[0]];
+                vy[k] = v[vi * 3 + axes[1]];
+            }
+        }
+        const float e0x = vx[1] - vx[0];
+        const float e0y = vy[1] - vy[0];
+        const float e1x = vx[2] - vx[1];
+        const float e1y = vy[2] - vy[1];
+        const float cross = e0x * e1y - e0y * e1x;
+        // Skip reflex corners
+        if (cross * area < 0.f) {
+            ++guess_vert;
+            continue;
+        }
+
+        // Check if any other vertices are inside this triangle
+        bool overlap = false;
+        for (size_t other_vert = 3; other_vert < npolys; ++other_vert) {
+            const size_t ovi = size_t(remaining[(guess_vert + other_vert) % npolys].vertex);
+            if (ovi * 3 + axes[0] >= v.size() || ovi * 3 + axes[1] >= v.size()) {
+                continue;
+            }
+            if (pnpoly(3, vx, vy, v[ovi * 3 + axes[0]], v[ovi * 3 + axes[1]])) {
+                overlap = true;
+                break;
+            }
+        }
+        if (overlap) {
+            ++guess_vert;
+            continue;
+        }
+
+        // This triangle is an ear, clip it and remove its middle vertex
+        out.insert(out.end(), ind, ind + 3);
+        remaining.erase(remaining.begin() + (guess_vert + 1) % npolys);
+    }
+
+    if (remaining.size() == 3) {
+        out.insert(out.end(), remaining.begin(), remaining.end());
+    }
+}
+
+// Triangulate the chunk's faces and find the triangle each command applies from
+void triangulate_chunk(OBJChunk &chunk, const std::vector<float> &vertices)
+{
+    if (chunk.face_sizes.empty()) {
+        for (auto &cmd : chunk.commands) {
+            cmd.triangle = cmd.face;
+        }
+        return;
+    }
+
+    std::vector<OBJIndex> triangles;
+    triangles.reserve(chunk.indices.size());
+    size_t next_command = 0;
+    size_t offset = 0;
+    for (size_t f = 0; f < chunk.face_sizes.size(); ++f) {
+        for (; next_command < chunk.commands.size() && chunk.commands[next_command].face == f;
+             ++next_command) {
+            chunk.commands[next_command].triangle = triangles.size() / 3;
+        }
+        triangulate_face(&chunk.indices[offset], chunk.face_sizes[f], vertices, triangles);
+        offset += chunk.face_sizes[f];
+    }
+    for (; next_command < chunk.commands.size(); ++next_command) {
+        chunk.commands[next_command].triangle = triangles.size() / 3;
+    }
+    chunk.indices.swap(triangles);
+    std::vector<uint32_t>().swap(chunk.face_sizes);
+}
+
+// A range of triangles in a chunk which belong to the same shape and use the same material
+struct OBJSegment {
+    size_t chunk;
+    size_t begin;
+    size_t end;
+    int32_t material_id;
+};
+
+struct OBJShapeSegments {
+    std::string name;
+    std::vector<OBJSegment> segments;
+    size_t num_triangles = 0;
+};
+
+/* Build the shape's geometry, deduplicating its vertices into a single index per position,
+ * normal and texcoord tuple. The shape's face vertices are sorted to group identical
+ * vertices, with ties broken by their position in the shape so that the first vertex of
+ * each group is where the vertex is first used. The vertices are then output in the order
+ * they're first used, matching the order of inserting them into a hash map while
+ * traversing the faces
+ */
+void build_shape(const OBJShapeSegments &segments,
+                 const std::vector<OBJChunk> &chunks,
+                 const std::vector<float> &vertices,
+                 const std::vector<float> &normals,
+                 const std::vector<float> &texcoords,
+                 OBJShape &shape)
+{
+    shape.name = segments.name;
+    shape.material_id = segments.segments.front().material_id;
+
+    const size_t num_face_vertices = segments.num_triangles * 3;
+    std::vector<glm::uvec3> face_vertices;
+    face_vertices.reserve(num_face_vertices);
+    for (const auto &s : segments.segments) {
+        shape.per_face_materials |= s.material_id != shape.material_id;
+
+        const auto &indices = chunks[s.chunk].indices;
+        for (size_t i = s.begin * 3; i < s.end * 3; ++i) {
+            const OBJIndex &idx = indices[i];
+            if (idx.vertex < 0 || size_t(idx.vertex) >= vertices.size() / 3 ||
+                size_t(idx.normal + 1) > normals.size() / 3 ||
+                size_t(idx.texcoord + 1) > texcoords.size() / 2) {
+                throw std::runtime_error("Invalid vertex index in OBJ shape " + shape.name);
+            }
+            face_vertices.emplace_back(idx.vertex, idx.normal, idx.texcoord);
+        }
+    }
+
+    std::vector<uint32_t> order(num_face_vertices);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](const uint32_t a, const uint32_t b) {
+        const glm::uvec3 &va = face_vertices[a];
+        const glm::uvec3 &vb = face_vertices[b];
+        if (va.x != vb.x) {
+            return va.x < vb.x;
+        }
+        if (va.y != vb.y) {
+            return va.y < vb.y;
+        }
+        if (va.z != vb.z) {
+            return va.z < vb.z;
+        }
+        return a < b;
+    });
+
+    // Find the first use of each face vertex's position, normal and texcoord tuple
+    std::vector<uint32_t> first_use(num_face_vertices);
+    for (size_t i = 0; i < num_face_vertices;) {
+        const uint32_t first = order[i];
+        for (; i < num_face_vertices && face_vertices[order[i]] == face_vertices[first];
+             ++i) {
+            first_use[order[i]] = first;
+        }
+    }
+    std::vector<uint32_t>().swap(order);
+
+    Geometry &geom = shape.geometry;
+    geom.indices.reserve(segments.num_triangles);
+    std::vector<uint32_t> vertex_ids(num_face_vertices);
+    glm::uvec3 tri_indices;
+    for (size_t i = 0; i < num_face_vertices; ++i) {
+        if (first_use[i] == i) {
+            const glm::uvec3 &idx = face_vertices[i];
+            vertex_ids[i] = geom.vertices.size();
+
+            geom.vertices.emplace_back(
+                vertices[3 * idx.x], vertices[3 * idx.x + 1], vertices[3 * idx.x + 2]);
+
+            if (idx.y != uint32_t(-1)) {
+                glm::vec3 n(
+                    normals[3 * idx.y], normals[3 * idx.y + 1], normals[3 * idx.y + 2]);
+                geom.normals.push_back(glm::normalize(n));
+            }
+
+            if (idx.z != uint32_t(-1)) {
+                geom.uvs.emplace_back(texcoords[2 * idx.z], texcoords[2 * idx.z + 1]);
+            }
+        }
+        tri_indices[i % 3] = vertex_ids[first_use[i]];
+        if (i % 3 == 2) {
+            geom.indices.push_back(tri_indices);
+        }
+    }
+}
+
+}
+
+OBJModel load_obj_file(const std::string &file,
+                       const std::string &mtl_base_dir,
+                       std::string &warn)
+{
+    FileMapping mapping(file);
+    const char *data = reinterpret_cast<const char *>(mapping.data());
+    const char *data_end = data + mapping.nbytes();
+
+    // Split the file into chunks at line boundaries
+    const size_t num_chunks = std::max(
+        size_t(1), std::min(4 * num_hardware_threads(), mapping.nbytes() / MIN_CHUNK_SIZE));
+    std::vector<const char *> chunk_starts = {data};
+    for (size_t i = 1; i < num_chunks; ++i) {
+        const char *p =
+            std::max(data + i * (mapping.nbytes() / num_chunks), chunk_starts.back());
+        p = static_cast<const char *>(std::memchr(p, '\n', data_end - p));
+        chunk_starts.push_back(p ? p + 1 : data_end);
+    }
+    chunk_starts.push_back(data_end);
+
+    std::vector<OBJChunk> chunks(num_chunks);
+    parallel_for(num_chunks, [&](const size_t i) {
+        parse_chunk(chunk_starts[i], chunk_starts[i + 1], chunks[i]);
+    });
+
+    // Offset each chunk's attributes and resolve any relative indices
+    std::vector<size_t> vertex_offsets(num_chunks + 1, 0);
+    std::vector<size_t> normal_offsets(num_chunks + 1, 0);
+    std::vector<size_t> texcoord_offsets(num_chunks + 1, 0);
+    for (size_t i = 0; i < num_chunks; ++i) {
+        vertex_offsets[i + 1] = vertex_offsets[i] + chunks[i].vertices.size();
+        normal_offsets[i + 1] = normal_offsets[i] + chunks[i].normals.size();
+        texcoord_offsets[i + 1] = texcoord_offsets[i] + chunks[i].texcoords.size();
+    }
+
+    std::vector<float> vertices(vertex_offsets.back());
+    std::vector<float> normals(normal_offsets.back());
+    std::vector<float> texcoords(texcoord_offsets.back());
+    parallel_for(num_chunks, [&](const size_t i) {
+        OBJChunk &chunk = chunks[i];
+        std::copy(chunk.vertices.begin(),
+                  chunk.vertices.end(),
+                  vertices.begin() + vertex_offsets[i]);
+        std::copy(
+            chunk.normals.begin(), chunk.normals.end(), normals.begin() + normal_offsets[i]);
+        std::copy(chunk.texcoords.begin(),
+                  chunk.texcoords.end(),
+                  texcoords.begin() + texcoord_offsets[i]);
+        std::vector<float>().swap(chunk.vertices);
+        std::vector<float>().swap(chunk.normals);
+        std::vector<float>().swap(chunk.texcoords);
+
+        if (!chunk.has_relative_indices) {
+            return;
+        }
+        for (auto &idx : chunk.indices) {
+            if (idx.relative & RELATIVE_VERTEX) {
+                idx.vertex += vertex_offsets[i] / 3;
+            }
+            if (idx.relative & RELATIVE_NORMAL) {
+                idx.normal += normal_offsets[i] / 3;
+            }
+            if (idx.relative & RELATIVE_TEXCOORD) {
+                idx.texcoord += texcoord_offsets[i] / 2;
+            }
+            idx.relative = 0;
+        }
+    });
+
+    parallel_for(num_chunks, [&](const size_t i) { triangulate_chunk(chunks[i], vertices); });
+
+    // Walk the commands in order to split the triangles into shapes and assign materials
+    OBJModel model;
+    std::map<std::string, int> material_map;
+    std::string base_dir = mtl_base_dir;
+    if (!base_dir.empty() && base_dir.back() != '/') {
+        base_dir += '/';
+    }
+    tinyobj::MaterialFileReader mtl_reader(base_dir);
+
+    std::vector<OBJShapeSegments> shape_segments(1);
+    int32_t material_id = -1;
+    auto add_segment = [&](const size_t chunk, const size_t begin, const size_t end) {
+        if (begin < end) {
+            shape_segments.back().segments.push_back(
+                OBJSegment{chunk, begin, end, material_id});
+            shape_segments.back().num_triangles += end - begin;
+        }
+    };
+    for (size_t i = 0; i < num_chunks; ++i) {
+        size_t begin = 0;
+        for (const auto &cmd : chunks[i].commands) {
+            add_segment(i, begin, cmd.triangle);
+            begin = cmd.triangle;
+
+            if (cmd.type == OBJCommand::GROUP) {
+                if (shape_segments.back().num_triangles > 0) {
+                    shape_segments.emplace_back();
+                }
+                shape_segments.back().name = cmd.name;
+            } else if (cmd.type == OBJCommand::USEMTL) {
+                auto fnd = material_map.find(cmd.name);
+                material_id = fnd != material_map.end() ? fnd->second : -1;
+            } else if (cmd.type == OBJCommand::MTLLIB) {
+                std::vector<std::string> filenames;
+                for (const char *p = cmd.name.c_str(); *p;) {
+                    const char *name_end = std::strchr(p, ' ');
+                    name_end = name_end ? name_end : p + std::strlen(p);
+                    if (name_end != p) {
+                        filenames.emplace_back(p, name_end);
+                    }
+                    p = *name_end ? name_end + 1 : name_end;
+                }
+
+                bool found = false;
+                for (const auto &f : filenames) {
+                    std::string mtl_warn, mtl_err;
+                    found =
+                        mtl_reader(f, &model.materials, &material_map, &mtl_warn, &mtl_err);
+                    warn += mtl_warn + mtl_err;
+                    if (found) {
+                        break;
+                    }
+                }
+                if (!found) {
+                    warn += "Failed to load material file(s) " + cmd.name + "\n";
+                }
+            }
+        }
+        add_segment(i, begin, chunks[i].num_triangles());
+    }
+    if (shape_segments.back().num_triangles == 0) {
+        shape_segments.pop_back();
+    }
+
+    // Build the shapes in parallel, starting with the largest
+    model.shapes.resize(shape_segments.size());
+    std::vector<size_t> shape_order(shape_segments.size());
+    std::iota(shape_order.begin(), shape_order.end(), 0);
+    std::sort(shape_order.begin(), shape_order.end(), [&](const size_t a, const size_t b) {
+        return shape_segments[a].num_triangles > shape_segments[b].num_triangles;
+    });
+    parallel_for(shape_order.size(), [&](const size_t i) {
+        const size_t s = shape_order[i];
+        build_shape(shape_segments[s], chunks, vertices, normals, texcoords, model.shapes[s]);
+    });
+    return model;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "mesh.h"
+#include "tiny_obj_loader.h"
+
+struct OBJShape {
+    std::string name;
+    Geometry geometry;
+    // The material ID of the shape's first face, or -1 if it has no material
+    int32_t material_id = -1;
+    // Set if the shape's faces use different materials
+    bool per_face_materials = false;
+};
+
+struct OBJModel {
+    std::vector<OBJShape> shapes;
+    std::vector<tinyobj::material_t> materials;
+};
+
+/* Load the OBJ file by mapping it into memory and parsing chunks of the file in parallel.
+ * Polygons are triangulated by ear clipping in the same way as tinyobjloader, and each
+ * shape's vertices are deduplicated into a single index per position, normal and texcoord
+ * tuple, in parallel over the shapes. The vertices of each shape are in the order they're
+ * first referenced, matching the geometry previously built from tinyobjloader's output.
+ * Material libraries are loaded relative to mtl_base_dir with tinyobjloader. Warnings are
+ * appended to warn
+ */
+OBJModel load_obj_file(const std::string &file,
+                       const std::string &mtl_base_dir,
+                       std::string &warn);
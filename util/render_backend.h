@@ -1,5 +1,8 @@
 #pragma once
 
+#include <limits>
+#include <string>
+#include <utility>
 #include <vector>
 #include "scene.h"
 #include <glm/glm.hpp>
@@ -7,10 +10,32 @@
 struct RenderStats {
     float render_time = 0;
     float rays_per_second = 0;
+    // The fraction of SIMD lanes doing useful work while tracing, or -1 if not tracked
+    float lane_occupancy = -1;
+    // Set by backends doing adaptive sampling once every pixel has converged
+    bool converged = false;
 };
 
+// Parameters controlling how long the paths traced by the backend are
+struct PathParams {
+    // The maximum number of bounces a path can take
+    uint32_t max_depth = 5;
+    // The number of bounces a path takes before it can be terminated by Russian roulette
+    // based on its throughput. Roulette is disabled if this is not less than max_depth
+    uint32_t roulette_min_depth = std::numeric_limits<uint32_t>::max();
+};
+
+// The arbitrary output variables (AOVs) which backends can write alongside the image
+enum class AOV { DEPTH, NORMAL, ALBEDO, INSTANCE_ID, MATERIAL_ID, SAMPLE_COUNT };
+
 struct RenderBackend {
     std::vector<uint32_t> img;
+    PathParams path_params;
+    /* The time taken by each stage of the last set_scene call in milliseconds, if reported
+     * by the backend. Stages may run concurrently, so the times can sum to more than the
+     * total time taken by set_scene
+     */
+    std::vector<std::pair<std::string, float>> set_scene_stage_times;
 
     virtual ~RenderBackend() {}
 
@@ -21,6 +46,63 @@ struct RenderBackend {
     // TODO Probably should take the scene through a shared_ptr
     virtual void set_scene(const Scene &scene) = 0;
 
+    /* Update the transforms of the instances with the given indices into the scene's
+     * instances passed to set_scene, without rebuilding the rest of the scene. Backends
+     * which support this rebuild only the top-level acceleration structure and restart
+     * accumulation. Returns false if the backend doesn't support updating instances, in
+     * which case set_scene must be called with the modified scene
+     */
+    virtual bool update_instances(const std::vector<uint32_t> &,
+                                  const std::vector<glm::mat4> &)
+    {
+        return false;
+    }
+
+    /* Update the vertex positions and normals of the meshes with the given indices from the
+     * scene, which must have the same number of vertices and triangles as the scene passed
+     * to set_scene. Backends which support this refit the meshes' BVHs instead of rebuilding
+     * them and restart accumulation. Returns false if the backend doesn't support updating
+     * meshes, in which case set_scene must be called with the modified scene
+     */
+    virtual bool update_meshes(const std::vector<uint32_t> &, const Scene &)
+    {
+        return false;
+    }
+
+    /* Replace the materials with the given indices, without rebuilding any BVHs or
+     * reuploading textures. Backends restart accumulation after updating the materials.
+     * Returns false if the backend doesn't support updating materials, in which case
+     * set_scene must be called with the modified scene
+     */
+    virtual bool update_materials(const std::vector<uint32_t> &,
+                                  const std::vector<DisneyMaterial> &)
+    {
+        return false;
+    }
+
+    /* Set the path parameters to use for the following frames, backends which support
+     * changing them at runtime will restart accumulation. The GPU backends use a fixed
+     * maximum depth set at compile time and ignore these parameters
+     */
+    virtual void set_path_params(const PathParams &params)
+    {
+        path_params = params;
+    }
+
+    /* Read back an AOV for the current image, with the pixels in the same order as img.
+     * The depth, normal and albedo are read as floats with 1, 3 and 3 channels, the instance
+     * ID, material ID and sample count as a single uint32 channel. Returns false if the
+     * backend doesn't support the AOV, it isn't enabled, or it isn't of the requested type
+     */
+    virtual bool read_aov(const AOV, std::vector<float> &)
+    {
+        return false;
+    }
+    virtual bool read_aov(const AOV, std::vector<uint32_t> &)
+    {
+        return false;
+    }
+
     // Returns the rays per-second achieved, or -1 if this is not tracked
     virtual RenderStats render(const glm::vec3 &pos,
                                const glm::vec3 &dir,
@@ -28,4 +110,45 @@ struct RenderBackend {
                                const float fovy,
                                const bool camera_changed,
                                const bool readback_framebuffer) = 0;
+
+    /* Render samples_per_call samples per-pixel, returning the stats for all the samples
+     * taken. Backends which can take multiple samples in a single launch override this,
+     * by default render is called once for each sample
+     */
+    virtual RenderStats render_samples(const glm::vec3 &pos,
+                                       const glm::vec3 &dir,
+                                       const glm::vec3 &up,
+                                       const float fovy,
+                                       const bool camera_changed,
+                                       const bool readback_framebuffer,
+                                       const uint32_t samples_per_call)
+    {
+        RenderStats stats;
+        float total_rays = 0;
+        float lane_occupancy = 0;
+        uint32_t num_samples = 0;
+        for (uint32_t i = 0; i < samples_per_call; ++i) {
+            const RenderStats s = render(pos,
+                                         dir,
+                                         up,
+                                         fovy,
+                                         camera_changed && i == 0,
+                                         readback_framebuffer && i + 1 == samples_per_call);
+            stats.render_time += s.render_time;
+            total_rays += s.rays_per_second * s.render_time;
+            lane_occupancy += s.lane_occupancy;
+            stats.converged = s.converged;
+            ++num_samples;
+            if (stats.converged) {
+                break;
+            }
+        }
+        if (total_rays > 0 && stats.render_time > 0) {
+            stats.rays_per_second = total_rays / stats.render_time;
+        }
+        if (num_samples > 0 && lane_occupancy >= 0) {
+            stats.lane_occupancy = lane_occupancy / num_samples;
+        }
+        return stats;
+    }
 };
@@ -1,40 +1,38 @@
 #include "scene.h"
 #include <algorithm>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <numeric>
 #include <stdexcept>
+#include <type_traits>
 #include <vector>
 #include "buffer_view.h"
 #include "file_mapping.h"
 #include "flatten_gltf.h"
 #include "gltf_types.h"
 #include "json.hpp"
+#include "obj_loader.h"
 #include "phmap_utils.h"
+#include "scene_cache.h"
 #include "stb_image.h"
 #include "tiny_gltf.h"
-#include "tiny_obj_loader.h"
 #include "util.h"
 #include <glm/ext.hpp>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
-namespace std {
-template <>
-struct hash<glm::uvec3> {
-    size_t operator()(glm::uvec3 const &v) const
-    {
-        return phmap::HashState().combine(0, v.x, v.y, v.z);
-    }
-};
-}
-
-bool operator==(const glm::uvec3 &a, const glm::uvec3 &b)
+Scene::Scene(const std::string &fname, const bool use_cache)
 {
-    return a.x == b.x && a.y == b.y && a.z == b.z;
-}
+    SceneCacheKey cache_key;
+    if (use_cache) {
+        cache_key = SceneCacheKey(fname);
+        if (read_scene_cache(scene_cache_file(fname), cache_key, *this)) {
+            std::cout << "Loaded scene from cache " << scene_cache_file(fname) << "\n";
+            return;
+        }
+    }
 
-Scene::Scene(const std::string &fname)
-{
     const std::string ext = get_file_extension(fname);
     if (ext == "obj") {
         load_obj(fname);
@@ -50,6 +48,14 @@ Scene::Scene(const std::string &fname)
         std::cout << "Unsupported file type '" << ext << "'\n";
         throw std::runtime_error("Unsupported file type " + ext);
     }
+
+    if (use_cache) {
+        try {
+            write_scene_cache(scene_cache_file(fname), cache_key, *this);
+        } catch (const std::runtime_error &e) {
+            std::cout << "Failed to write scene cache: " << e.what() << "\n";
+        }
+    }
 }
 
 size_t Scene::unique_tris() const
@@ -80,85 +86,27 @@ void Scene::load_obj(const std::string &file)
 {
     std::cout << "Loading OBJ: " << file << "\n";
 
-    // Load the model w/ tinyobjloader. We just take any OBJ groups etc. stuff
+    // Load the model w/ our parallel OBJ loader. We just take any OBJ groups etc. stuff
     // that may be in the file and dump them all into a single OBJ model.
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> obj_materials;
-    std::string err, warn;
     const std::string obj_base_dir = file.substr(0, file.rfind('/'));
-    bool ret = tinyobj::LoadObj(
-        &attrib, &shapes, &obj_materials, &warn, &err, file.c_str(), obj_base_dir.c_str());
+    std::string warn;
+    OBJModel model = load_obj_file(file, obj_base_dir, warn);
     if (!warn.empty()) {
-        std::cout << "TinyOBJ loading '" << file << "': " << warn << "\n";
-    }
-    if (!ret || !err.empty()) {
-        throw std::runtime_error("TinyOBJ Error loading " + file + " error: " + err);
+        std::cout << "Loading OBJ '" << file << "': " << warn << "\n";
     }
 
     Mesh mesh;
     std::vector<uint32_t> material_ids;
-    for (size_t s = 0; s < shapes.size(); ++s) {
-        // We load with triangulate on so we know the mesh will be all triangle faces
-        const tinyobj::mesh_t &obj_mesh = shapes[s].mesh;
-
-        // We've got to remap from 3 indices per-vert (independent for pos, normal & uv) used
-        // by tinyobjloader over to single index per-vert (single for pos, normal & uv tuple)
-        // used by renderers
-        phmap::parallel_flat_hash_map<glm::uvec3, uint32_t> index_mapping;
-        Geometry geom;
+    for (auto &shape : model.shapes) {
         // Note: not supporting per-primitive materials
-        material_ids.push_back(obj_mesh.material_ids[0]);
-
-        auto minmax_matid =
-            std::minmax_element(obj_mesh.material_ids.begin(), obj_mesh.material_ids.end());
-        if (*minmax_matid.first != *minmax_matid.second) {
+        material_ids.push_back(shape.material_id);
+        if (shape.per_face_materials) {
             std::cout
                 << "Warning: per-face material IDs are not supported, materials may look "
                    "wrong."
                    " Please reexport your mesh with each material group as an OBJ group\n";
         }
-
-        for (size_t f = 0; f < obj_mesh.num_face_vertices.size(); ++f) {
-            if (obj_mesh.num_face_vertices[f] != 3) {
-                throw std::runtime_error("Non-triangle face found in " + file + "-" +
-                                         shapes[s].name);
-            }
-
-            glm::uvec3 tri_indices;
-            for (size_t i = 0; i < 3; ++i) {
-                const glm::uvec3 idx(obj_mesh.indices[f * 3 + i].vertex_index,
-                                     obj_mesh.indices[f * 3 + i].normal_index,
-                                     obj_mesh.indices[f * 3 + i].texcoord_index);
-                uint32_t vert_idx = 0;
-                auto fnd = index_mapping.find(idx);
-                if (fnd != index_mapping.end()) {
-                    vert_idx = fnd->second;
-                } else {
-                    vert_idx = geom.vertices.size();
-                    index_mapping[idx] = vert_idx;
-
-                    geom.vertices.emplace_back(attrib.vertices[3 * idx.x],
-                                               attrib.vertices[3 * idx.x + 1],
-                                               attrib.vertices[3 * idx.x + 2]);
-
-                    if (idx.y != uint32_t(-1)) {
-                        glm::vec3 n(attrib.normals[3 * idx.y],
-                                    attrib.normals[3 * idx.y + 1],
-                                    attrib.normals[3 * idx.y + 2]);
-                        geom.normals.push_back(glm::normalize(n));
-                    }
-
-                    if (idx.z != uint32_t(-1)) {
-                        geom.uvs.emplace_back(attrib.texcoords[2 * idx.z],
-                                              attrib.texcoords[2 * idx.z + 1]);
-                    }
-                }
-                tri_indices[i] = vert_idx;
-            }
-            geom.indices.push_back(tri_indices);
-        }
-        mesh.geometries.push_back(geom);
+        mesh.geometries.push_back(std::move(shape.geometry));
     }
     meshes.push_back(mesh);
 
@@ -167,7 +115,7 @@ void Scene::load_obj(const std::string &file)
 
     phmap::parallel_flat_hash_map<std::string, int32_t> texture_ids;
     // Parse the materials over to a similar DisneyMaterial representation
-    for (const auto &m : obj_materials) {
+    for (const auto &m : model.materials) {
         DisneyMaterial d;
         d.base_color = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
         d.specular = glm::clamp(m.shininess / 500.f, 0.f, 1.f);
@@ -381,105 +329,189 @@ void Scene::load_gltf(const std::string &fname)
     lights.push_back(light);
 }
 
-void Scene::load_crts(const std::string &file)
-{
+namespace {
+
+/* Streams the CRTS JSON header with a SAX parser, building a json DOM of just one record at
+ * a time and passing it to the callback along with the name of its section. The records are
+ * the elements of the header's top level arrays, e.g., each buffer view, mesh or object,
+ * while other top level values are passed as a single record. Only keeping one record in
+ * memory avoids building a DOM of the whole header, which is large for big scenes.
+ */
+class CRTSHeaderReader : public nlohmann::json_sax<nlohmann::json> {
     using json = nlohmann::json;
-    std::cout << "Loading CRTS " << file << "\n";
 
-    auto mapping = std::make_shared<FileMapping>(file);
-    const uint64_t json_header_size = *reinterpret_cast<const uint64_t *>(mapping->data());
-    const uint64_t total_header_size = json_header_size + sizeof(uint64_t);
-    json header =
-        json::parse(mapping->data() + sizeof(uint64_t), mapping->data() + total_header_size);
+    std::function<void(const std::string &, json &)> callback;
+    std::string section;
+    std::string current_key;
+    json record;
+    // The containers being built in the current record
+    std::vector<json *> stack;
+    // The number of containers open in the header, including the root object
+    size_t depth = 0;
 
-    const uint8_t *data_base = mapping->data() + total_header_size;
-    // Blender only supports a single geometry per-mesh so this works kind of like a blend of
-    // GLTF and OBJ
-    for (size_t i = 0; i < header["meshes"].size(); ++i) {
-        auto &m = header["meshes"][i];
+    bool value(json &&val)
+    {
+        if (!stack.empty()) {
+            json *parent = stack.back();
+            if (parent->is_array()) {
+                parent->push_back(std::move(val));
+            } else {
+                (*parent)[current_key] = std::move(val);
+            }
+        } else if (depth == 1 || depth == 2) {
+            record = std::move(val);
+            callback(section, record);
+        }
+        return true;
+    }
 
-        Geometry geom;
-        {
-            const uint64_t view_id = m["positions"].get<uint64_t>();
-            auto &v = header["buffer_views"][view_id];
-            const DTYPE dtype = parse_dtype(v["type"]);
-            BufferView view(data_base + v["byte_offset"].get<uint64_t>(),
-                            v["byte_length"].get<uint64_t>(),
-                            dtype_stride(dtype));
-            Accessor<glm::vec3> accessor(view);
-            geom.vertices = std::vector<glm::vec3>(accessor.begin(), accessor.end());
-        }
-        {
-            const uint64_t view_id = m["indices"].get<uint64_t>();
-            auto &v = header["buffer_views"][view_id];
-            const DTYPE dtype = parse_dtype(v["type"]);
-            BufferView view(data_base + v["byte_offset"].get<uint64_t>(),
-                            v["byte_length"].get<uint64_t>(),
-                            dtype_stride(dtype));
-            Accessor<glm::uvec3> accessor(view);
-            geom.indices = std::vector<glm::uvec3>(accessor.begin(), accessor.end());
-        }
-        if (m.find("texcoords") != m.end()) {
-            const uint64_t view_id = m["texcoords"].get<uint64_t>();
-            auto &v = header["buffer_views"][view_id];
-            const DTYPE dtype = parse_dtype(v["type"]);
-            BufferView view(data_base + v["byte_offset"].get<uint64_t>(),
-                            v["byte_length"].get<uint64_t>(),
-                            dtype_stride(dtype));
-            Accessor<glm::vec2> accessor(view);
-            geom.uvs = std::vector<glm::vec2>(accessor.begin(), accessor.end());
+    bool start_container(json &&container)
+    {
+        if (depth == 0) {
+            if (!container.is_object()) {
+                throw std::runtime_error("CRTS header is not a JSON object");
+            }
+        } else if (!stack.empty()) {
+            json *parent = stack.back();
+            if (parent->is_array()) {
+                parent->push_back(std::move(container));
+                stack.push_back(&parent->back());
+            } else {
+                json &child = (*parent)[current_key];
+                child = std::move(container);
+                stack.push_back(&child);
+            }
+        } else if (depth == 2 || !container.is_array()) {
+            // Start a record, the top level arrays themselves aren't kept
+            record = std::move(container);
+            stack.push_back(&record);
         }
-#if 0
-        if (m.find("normals") != m.end()) {
-            const uint64_t view_id = m["normals"].get<uint64_t>();
-            auto &v = header["buffer_views"][view_id];
-            const DTYPE dtype = parse_dtype(v["type"]);
-            BufferView view(data_base + v["byte_offset"].get<uint64_t>(),
-                            v["byte_length"].get<uint64_t>(),
-                            dtype_stride(dtype));
-            Accessor<glm::vec3> accessor(view);
-            geom.normals = std::vector<glm::vec3>(accessor.begin(), accessor.end());
+        ++depth;
+        return true;
+    }
+
+    bool end_container()
+    {
+        --depth;
+        if (!stack.empty()) {
+            stack.pop_back();
+            if (stack.empty()) {
+                callback(section, record);
+                record = json();
+            }
         }
-#endif
+        return true;
+    }
 
-        Mesh mesh;
-        mesh.geometries.push_back(geom);
-        meshes.push_back(mesh);
+public:
+    CRTSHeaderReader(const std::function<void(const std::string &, json &)> &callback)
+        : callback(callback)
+    {
     }
 
-    for (size_t i = 0; i < header["images"].size(); ++i) {
-        auto &img = header["images"][i];
+    bool null() override
+    {
+        return value(json());
+    }
 
-        const uint64_t view_id = img["view"].get<uint64_t>();
-        auto &v = header["buffer_views"][view_id];
-        const DTYPE dtype = parse_dtype(v["type"]);
-        BufferView view(data_base + v["byte_offset"].get<uint64_t>(),
-                        v["byte_length"].get<uint64_t>(),
-                        dtype_stride(dtype));
-        Accessor<uint8_t> accessor(view);
+    bool boolean(bool val) override
+    {
+        return value(json(val));
+    }
 
-        stbi_set_flip_vertically_on_load(1);
-        int x, y, n;
-        uint8_t *img_data =
-            stbi_load_from_memory(accessor.begin(), accessor.size(), &x, &y, &n, 4);
-        stbi_set_flip_vertically_on_load(0);
-        if (!img_data) {
-            std::cout << "Failed to load " << img["name"].get<std::string>() << " from view\n";
-            throw std::runtime_error("Failed to load " + img["name"].get<std::string>());
-        }
+    bool number_integer(number_integer_t val) override
+    {
+        return value(json(val));
+    }
 
-        ColorSpace color_space = SRGB;
-        if (img["color_space"].get<std::string>() == "LINEAR") {
-            color_space = LINEAR;
+    bool number_unsigned(number_unsigned_t val) override
+    {
+        return value(json(val));
+    }
+
+    bool number_float(number_float_t val, const string_t &) override
+    {
+        return value(json(val));
+    }
+
+    bool string(string_t &val) override
+    {
+        return value(json(std::move(val)));
+    }
+
+    bool start_object(std::size_t) override
+    {
+        return start_container(json::object());
+    }
+
+    bool key(string_t &val) override
+    {
+        if (depth == 1) {
+            section = val;
+        } else {
+            current_key = val;
         }
+        return true;
+    }
 
-        textures.emplace_back(img_data, x, y, 4, img["name"].get<std::string>(), color_space);
-        stbi_image_free(img_data);
+    bool end_object() override
+    {
+        return end_container();
     }
 
-    for (size_t i = 0; i < header["materials"].size(); ++i) {
-        auto &m = header["materials"][i];
+    bool start_array(std::size_t) override
+    {
+        return start_container(json::array());
+    }
+
+    bool end_array() override
+    {
+        return end_container();
+    }
+
+    bool parse_error(std::size_t position,
+                     const std::string &,
+                     const nlohmann::detail::exception &ex) override
+    {
+        throw std::runtime_error("Failed to parse CRTS header at byte " +
+                                 std::to_string(position) + ": " + ex.what());
+    }
+};
+
+struct CRTSBufferView {
+    uint64_t byte_offset = 0;
+    uint64_t byte_length = 0;
+    size_t stride = 0;
+};
 
+struct CRTSMesh {
+    uint64_t positions = 0;
+    uint64_t indices = 0;
+    int64_t texcoords = -1;
+    int64_t normals = -1;
+};
+
+}
+
+void Scene::load_crts(const std::string &file)
+{
+    using json = nlohmann::json;
+    std::cout << "Loading CRTS " << file << "\n";
+
+    auto mapping = std::make_shared<FileMapping>(file);
+    const uint64_t json_header_size = *reinterpret_cast<const uint64_t *>(mapping->data());
+    const uint64_t total_header_size = json_header_size + sizeof(uint64_t);
+    const uint8_t *data_base = mapping->data() + total_header_size;
+
+    /* The buffer views, meshes and images are kept as compact records while parsing the
+     * header and loaded after, since the header's sections may be in any order. Materials
+     * and objects only refer to other records by index, so are loaded as they're parsed
+     */
+    std::vector<CRTSBufferView> buffer_views;
+    std::vector<CRTSMesh> crts_meshes;
+    std::vector<json> images;
+
+    auto load_material = [&](json &m) {
         DisneyMaterial mat;
 
         const auto base_color_data = m["base_color"].get<std::vector<float>>();
@@ -518,10 +550,9 @@ void Scene::load_crts(const std::string &file)
         parse_float_param("ior", mat.ior);
         parse_float_param("transmission", mat.specular_transmission);
         materials.push_back(mat);
-    }
+    };
 
-    for (size_t i = 0; i < header["objects"].size(); ++i) {
-        auto &n = header["objects"][i];
+    auto load_object = [&](json &n) {
         const std::string type = n["type"];
         const glm::mat4 matrix = glm::make_mat4(n["matrix"].get<std::vector<float>>().data());
         if (type == "MESH") {
@@ -551,6 +582,165 @@ void Scene::load_crts(const std::string &file)
         } else {
             throw std::runtime_error("Unsupported object type: not a mesh or camera?");
         }
+    };
+
+    CRTSHeaderReader reader([&](const std::string &section, json &record) {
+        if (section == "buffer_views") {
+            CRTSBufferView view;
+            view.byte_offset = record["byte_offset"].get<uint64_t>();
+            view.byte_length = record["byte_length"].get<uint64_t>();
+            view.stride = dtype_stride(parse_dtype(record["type"]));
+            buffer_views.push_back(view);
+        } else if (section == "meshes") {
+            CRTSMesh mesh;
+            mesh.positions = record["positions"].get<uint64_t>();
+            mesh.indices = record["indices"].get<uint64_t>();
+            if (record.find("texcoords") != record.end()) {
+                mesh.texcoords = record["texcoords"].get<int64_t>();
+            }
+            if (record.find("normals") != record.end()) {
+                mesh.normals = record["normals"].get<int64_t>();
+            }
+            crts_meshes.push_back(mesh);
+        } else if (section == "images") {
+            images.push_back(std::move(record));
+        } else if (section == "materials") {
+            load_material(record);
+        } else if (section == "objects") {
+            load_object(record);
+        }
+    });
+    json::sax_parse(mapping->data() + sizeof(uint64_t), data_base, &reader);
+
+    auto get_view = [&](const uint64_t view_id) -> const CRTSBufferView & {
+        if (view_id >= buffer_views.size()) {
+            throw std::runtime_error("Invalid CRTS buffer view " + std::to_string(view_id));
+        }
+        return buffer_views[view_id];
+    };
+
+    /* Reference the buffer view's data directly in the mapped file, with the array holding
+     * a reference to the mapping to keep it alive. The data is only referenced if it's
+     * tightly packed, 4 byte aligned and at least 16 bytes of the file follow it, since
+     * Embree reads vertices with SIMD loads. Otherwise it's copied
+     */
+    auto load_view = [&](const uint64_t view_id, auto &array) {
+        using T = typename std::decay<decltype(array)>::type::value_type;
+        const CRTSBufferView &v = get_view(view_id);
+        BufferView view(data_base + v.byte_offset, v.byte_length, v.stride);
+        Accessor<T> accessor(view);
+
+        const uint8_t *view_end = reinterpret_cast<const uint8_t *>(accessor.end());
+        const size_t bytes_after = mapping->data() + mapping->nbytes() - view_end;
+        if (v.stride == sizeof(T) && reinterpret_cast<uintptr_t>(accessor.begin()) % 4 == 0 &&
+            bytes_after >= 16) {
+            array = MappedArray<T>(mapping, accessor.begin(), accessor.size());
+        } else {
+            array = std::vector<T>(accessor.begin(), accessor.end());
+        }
+    };
+
+    // Blender only supports a single geometry per-mesh so this works kind of like a blend of
+    // GLTF and OBJ
+    for (const auto &m : crts_meshes) {
+        Geometry geom;
+        load_view(m.positions, geom.vertices);
+        load_view(m.indices, geom.indices);
+        if (m.texcoords >= 0) {
+            load_view(m.texcoords, geom.uvs);
+        }
+#if 0
+        if (m.normals >= 0) {
+            load_view(m.normals, geom.normals);
+        }
+#endif
+
+        Mesh mesh;
+        mesh.geometries.push_back(geom);
+        meshes.push_back(mesh);
+    }
+
+    /* Images are either stored encoded, e.g., as PNG or JPEG, or as raw 8-bit texels when
+     * the image's "format" is "RAW". Raw images declare their "width", "height", "channels"
+     * and "row_stride" in bytes, which may include padding to align each row. The rows are
+     * stored bottom to top, matching the flipped images decoded by stb_image. Raw images may
+     * also list a mip chain in "mips", where each level gives its "view", "width", "height"
+     * and "row_stride", though as none of the backends use mip mapping only the base level is
+     * loaded. Raw images are expanded to RGBA like decoded images, tightly packed RGBA images
+     * reference the mapped file directly
+     */
+    for (auto &img : images) {
+        const std::string name = img["name"].get<std::string>();
+
+        const uint64_t view_id = img["view"].get<uint64_t>();
+        const CRTSBufferView &v = get_view(view_id);
+        const uint8_t *view_data = data_base + v.byte_offset;
+        const uint64_t view_size = v.byte_length;
+
+        ColorSpace color_space = SRGB;
+        if (img["color_space"].get<std::string>() == "LINEAR") {
+            color_space = LINEAR;
+        }
+
+        if (img.find("format") != img.end() && img["format"].get<std::string>() == "RAW") {
+            const int width = img["width"].get<int>();
+            const int height = img["height"].get<int>();
+            const int channels = img["channels"].get<int>();
+
+            const size_t row_size = size_t(width) * channels;
+            const size_t row_stride = img["row_stride"].get<uint64_t>();
+            if (width < 1 || height < 1 || channels < 1 || channels > 4 ||
+                row_stride < row_size || view_size < row_stride * (height - 1) + row_size) {
+                throw std::runtime_error("Invalid raw image " + name);
+            }
+
+            Image texture;
+            texture.name = name;
+            texture.width = width;
+            texture.height = height;
+            texture.channels = 4;
+            texture.color_space = color_space;
+
+            // The backends expect RGBA8 textures, so only tightly packed RGBA images can be
+            // referenced directly. Others are expanded to RGBA the same way stb_image does
+            if (channels == 4 && row_stride == row_size) {
+                texture.img = MappedArray<uint8_t>(mapping, view_data, row_size * height);
+            } else {
+                std::vector<uint8_t> texels(size_t(width) * height * 4);
+                for (int y = 0; y < height; ++y) {
+                    const uint8_t *row = view_data + y * row_stride;
+                    uint8_t *out = texels.data() + size_t(y) * width * 4;
+                    for (int x = 0; x < width; ++x) {
+                        const uint8_t *px = row + x * channels;
+                        uint8_t *rgba = out + x * 4;
+                        if (channels < 3) {
+                            rgba[0] = rgba[1] = rgba[2] = px[0];
+                            rgba[3] = channels == 2 ? px[1] : 255;
+                        } else {
+                            rgba[0] = px[0];
+                            rgba[1] = px[1];
+                            rgba[2] = px[2];
+                            rgba[3] = channels == 4 ? px[3] : 255;
+                        }
+                    }
+                }
+                texture.img = std::move(texels);
+            }
+            textures.push_back(texture);
+            continue;
+        }
+
+        stbi_set_flip_vertically_on_load(1);
+        int x, y, n;
+        uint8_t *img_data = stbi_load_from_memory(view_data, view_size, &x, &y, &n, 4);
+        stbi_set_flip_vertically_on_load(0);
+        if (!img_data) {
+            std::cout << "Failed to load " << name << " from view\n";
+            throw std::runtime_error("Failed to load " + name);
+        }
+
+        textures.emplace_back(img_data, x, y, 4, name, color_space);
+        stbi_image_free(img_data);
     }
 
     validate_materials();
@@ -21,7 +21,10 @@ struct Scene {
     std::vector<QuadLight> lights;
     std::vector<Camera> cameras;
 
-    Scene(const std::string &fname);
+    /* Load the scene from the file. If use_cache is set the scene is loaded from its binary
+     * cache if it's up to date, otherwise the cache is written after loading the scene
+     */
+    Scene(const std::string &fname, const bool use_cache = false);
     Scene() = default;
 
     // Compute the unique number of triangles in the scene
@@ -0,0 +1,366 @@
+#include "scene_cache.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "file_mapping.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'C', 'R', 'T', 'C', 'A', 'C', 'H', 'E'};
+// Must be incremented whenever the layout of the cache or the cached types changes
+const uint32_t CACHE_VERSION = 3;
+// The geometry and texture arrays are aligned so they can be referenced directly in the mapped
+// cache
+const size_t ARRAY_ALIGNMENT = 16;
+
+// Hash the file contents 8 bytes at a time, mixing each word with the Murmur3 finalizer
+uint64_t hash_bytes(const uint8_t *data, const size_t nbytes)
+{
+    const auto mix = [](uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    };
+    uint64_t hash = nbytes;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= nbytes; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(uint64_t));
+        hash = mix(hash ^ word) + i;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, nbytes - i);
+    return mix(hash ^ tail);
+}
+
+class CacheWriter {
+    std::string fname;
+    std::ofstream fout;
+
+public:
+    CacheWriter(const std::string &fname) : fname(fname), fout(fname.c_str(), std::ios::binary)
+    {
+        if (!fout) {
+            throw std::runtime_error("Failed to open scene cache " + fname + " for writing");
+        }
+    }
+
+    // Flush and close the file, throwing if any of the writes failed
+    void close()
+    {
+        fout.close();
+        if (!fout) {
+            throw std::runtime_error("Failed to write scene cache " + fname);
+        }
+    }
+
+    template <typename T>
+    void write(const T &val)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Cached types must be POD");
+        fout.write(reinterpret_cast<const char *>(&val), sizeof(T));
+    }
+
+    template <typename T>
+    void write(const std::vector<T> &vec)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Cached types must be POD");
+        write(uint64_t(vec.size()));
+        fout.write(reinterpret_cast<const char *>(vec.data()), vec.size() * sizeof(T));
+    }
+
+    // Write the array's data aligned to ARRAY_ALIGNMENT bytes in the file
+    template <typename T>
+    void write(const MappedArray<T> &arr)
+    {
+        write(uint64_t(arr.size()));
+        const size_t offset = fout.tellp();
+        const size_t padding = (ARRAY_ALIGNMENT - offset % ARRAY_ALIGNMENT) % ARRAY_ALIGNMENT;
+        const char zeros[ARRAY_ALIGNMENT] = {0};
+        fout.write(zeros, padding);
+        fout.write(reinterpret_cast<const char *>(arr.data()), arr.size() * sizeof(T));
+    }
+
+    void write(const std::string &str)
+    {
+        write(uint64_t(str.size()));
+        fout.write(str.data(), str.size());
+    }
+};
+
+// Reads the cache directly from the mapped file, checking reads are within the file
+class CacheReader {
+    std::shared_ptr<FileMapping> mapping;
+    const uint8_t *ptr = nullptr;
+    const uint8_t *end = nullptr;
+
+    const uint8_t *advance(const size_t nbytes)
+    {
+        if (nbytes > size_t(end - ptr)) {
+            throw std::runtime_error("Scene cache is truncated");
+        }
+        const uint8_t *p = ptr;
+        ptr += nbytes;
+        return p;
+    }
+
+public:
+    CacheReader(const std::shared_ptr<FileMapping> &mapping)
+        : mapping(mapping), ptr(mapping->data()), end(mapping->data() + mapping->nbytes())
+    {
+    }
+
+    template <typename T>
+    void read(T &val)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Cached types must be POD");
+        std::memcpy(&val, advance(sizeof(T)), sizeof(T));
+    }
+
+    template <typename T>
+    void read(std::vector<T> &vec)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Cached types must be POD");
+        uint64_t count = 0;
+        read(count);
+        if (count > size_t(end - ptr) / sizeof(T)) {
+            throw std::runtime_error("Scene cache is truncated");
+        }
+        const uint8_t *data = advance(count * sizeof(T));
+        vec.resize(count);
+        std::memcpy(vec.data(), data, count * sizeof(T));
+    }
+
+    /* Reference the array's data in the mapped cache, if at least 16 bytes of the file
+     * follow it to allow for SIMD loads past its end, otherwise the data is copied
+     */
+    template <typename T>
+    void read(MappedArray<T> &arr)
+    {
+        uint64_t count = 0;
+        read(count);
+        const size_t offset = ptr - mapping->data();
+        advance((ARRAY_ALIGNMENT - offset % ARRAY_ALIGNMENT) % ARRAY_ALIGNMENT);
+        if (count > size_t(end - ptr) / sizeof(T)) {
+            throw std::runtime_error("Scene cache is truncated");
+        }
+        const T *data = reinterpret_cast<const T *>(advance(count * sizeof(T)));
+        if (end - ptr >= 16) {
+            arr = MappedArray<T>(mapping, data, count);
+        } else {
+            arr = std::vector<T>(data, data + count);
+        }
+    }
+
+    void read(std::string &str)
+    {
+        uint64_t len = 0;
+        read(len);
+        const uint8_t *data = advance(len);
+        str = std::string(reinterpret_cast<const char *>(data), len);
+    }
+};
+
+void write_scene_cache_file(const std::string &fname,
+                            const SceneCacheKey &key,
+                            const Scene &scene)
+{
+    CacheWriter writer(fname);
+    writer.write(CACHE_MAGIC);
+    writer.write(CACHE_VERSION);
+
+    writer.write(key.path);
+    writer.write(key.size);
+    writer.write(key.mtime);
+    writer.write(key.hash);
+
+    writer.write(uint64_t(scene.meshes.size()));
+    for (const auto &mesh : scene.meshes) {
+        writer.write(uint64_t(mesh.geometries.size()));
+        for (const auto &geom : mesh.geometries) {
+            writer.write(geom.vertices);
+            writer.write(geom.normals);
+            writer.write(geom.uvs);
+            writer.write(geom.indices);
+        }
+    }
+
+    writer.write(uint64_t(scene.instances.size()));
+    for (const auto &inst : scene.instances) {
+        writer.write(inst.transform);
+        writer.write(uint64_t(inst.mesh_id));
+        writer.write(inst.material_ids);
+    }
+
+    writer.write(scene.materials);
+
+    writer.write(uint64_t(scene.textures.size()));
+    for (const auto &img : scene.textures) {
+        writer.write(img.name);
+        writer.write(img.width);
+        writer.write(img.height);
+        writer.write(img.channels);
+        writer.write(uint32_t(img.color_space));
+        writer.write(img.img);
+    }
+
+    writer.write(scene.lights);
+    writer.write(scene.cameras);
+    writer.close();
+}
+
+}
+
+SceneCacheKey::SceneCacheKey(const std::string &fname) : path(fname)
+{
+    struct stat stat_buf;
+    if (stat(fname.c_str(), &stat_buf) != 0) {
+        throw std::runtime_error("Failed to stat scene file " + fname);
+    }
+    size = stat_buf.st_size;
+    mtime = stat_buf.st_mtime;
+
+    if (size > 0) {
+        FileMapping mapping(fname);
+        hash = hash_bytes(mapping.data(), mapping.nbytes());
+    }
+}
+
+bool SceneCacheKey::operator==(const SceneCacheKey &b) const
+{
+    return path == b.path && size == b.size && mtime == b.mtime && hash == b.hash;
+}
+
+std::string scene_cache_file(const std::string &fname)
+{
+    return fname + ".crtcache";
+}
+
+bool read_scene_cache(const std::string &cache_file, const SceneCacheKey &key, Scene &scene)
+{
+    if (!std::ifstream(cache_file.c_str())) {
+        return false;
+    }
+
+    try {
+        CacheReader reader(std::make_shared<FileMapping>(cache_file));
+
+        char magic[sizeof(CACHE_MAGIC)];
+        reader.read(magic);
+        uint32_t version = 0;
+        reader.read(version);
+        if (std::memcmp(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+            version != CACHE_VERSION) {
+            std::cout << "Scene cache " << cache_file << " is from another version\n";
+            return false;
+        }
+
+        SceneCacheKey cached_key;
+        reader.read(cached_key.path);
+        reader.read(cached_key.size);
+        reader.read(cached_key.mtime);
+        reader.read(cached_key.hash);
+        if (!(cached_key == key)) {
+            std::cout << "Scene cache " << cache_file << " is out of date\n";
+            return false;
+        }
+
+        Scene cached;
+        uint64_t num_meshes = 0;
+        reader.read(num_meshes);
+        cached.meshes.resize(num_meshes);
+        for (auto &mesh : cached.meshes) {
+            uint64_t num_geometries = 0;
+            reader.read(num_geometries);
+            mesh.geometries.resize(num_geometries);
+            for (auto &geom : mesh.geometries) {
+                reader.read(geom.vertices);
+                reader.read(geom.normals);
+                reader.read(geom.uvs);
+                reader.read(geom.indices);
+            }
+        }
+
+        uint64_t num_instances = 0;
+        reader.read(num_instances);
+        cached.instances.resize(num_instances);
+        for (auto &inst : cached.instances) {
+            uint64_t mesh_id = 0;
+            reader.read(inst.transform);
+            reader.read(mesh_id);
+            reader.read(inst.material_ids);
+            inst.mesh_id = mesh_id;
+        }
+
+        reader.read(cached.materials);
+
+        uint64_t num_textures = 0;
+        reader.read(num_textures);
+        cached.textures.resize(num_textures);
+        for (auto &img : cached.textures) {
+            uint32_t color_space = LINEAR;
+            reader.read(img.name);
+            reader.read(img.width);
+            reader.read(img.height);
+            reader.read(img.channels);
+            reader.read(color_space);
+            reader.read(img.img);
+            img.color_space = static_cast<ColorSpace>(color_space);
+        }
+
+        reader.read(cached.lights);
+        reader.read(cached.cameras);
+
+        scene = std::move(cached);
+    } catch (const std::runtime_error &e) {
+        std::cout << "Failed to read scene cache " << cache_file << ": " << e.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+void write_scene_cache(const std::string &cache_file,
+                       const SceneCacheKey &key,
+                       const Scene &scene)
+{
+    /* Other processes may be reading the cache through a mapping, or writing it, so the cache
+     * is written to a uniquely named temporary file in the same directory and renamed over
+     * the cache file once it's complete
+     */
+    const std::string tmp_file =
+        cache_file + ".tmp." + std::to_string(std::random_device()()) + "." +
+        std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    try {
+        write_scene_cache_file(tmp_file, key, scene);
+    } catch (const std::runtime_error &) {
+        std::remove(tmp_file.c_str());
+        throw;
+    }
+
+#ifdef _WIN32
+    const bool renamed =
+        MoveFileExA(tmp_file.c_str(), cache_file.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    const bool renamed = std::rename(tmp_file.c_str(), cache_file.c_str()) == 0;
+#endif
+    if (!renamed) {
+        std::remove(tmp_file.c_str());
+        throw std::runtime_error("Failed to replace scene cache " + cache_file);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include "scene.h"
+
+/* A binary cache of a fully loaded scene, holding the processed meshes, instances,
+ * materials, decoded textures, lights and cameras so the scene can be reloaded without
+ * parsing the source file or decoding its images. The geometry and textures loaded from the
+ * cache reference the mapped cache file directly. The cache is keyed on the source file's
+ * path, size, modification time and a hash of its contents. Note that files referenced by
+ * the source file, e.g., OBJ material libraries or textures, are not part of the key
+ */
+struct SceneCacheKey {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t hash = 0;
+
+    // Compute the key for the source scene file
+    SceneCacheKey(const std::string &fname);
+    SceneCacheKey() = default;
+
+    bool operator==(const SceneCacheKey &b) const;
+};
+
+// Get the cache file path used for the scene file
+std::string scene_cache_file(const std::string &fname);
+
+/* Load the scene from the cache file if it exists, is the current version and was written
+ * for the same source file key. Returns false if the cache can't be used
+ */
+bool read_scene_cache(const std::string &cache_file, const SceneCacheKey &key, Scene &scene);
+
+/* Write the scene to the cache file. The cache is written to a temporary file in the same
+ * directory and renamed over cache_file, so readers never see a partially written cache
+ */
+void write_scene_cache(const std::string &cache_file,
+                       const SceneCacheKey &key,
+                       const Scene &scene);
@@ -2,8 +2,11 @@
 #include <array>
 #ifdef _WIN32
 #include <intrin.h>
+#include <windows.h>
+#include <psapi.h>
 #else
 #include <cpuid.h>
+#include <sys/resource.h>
 #endif
 #include "util.h"
 #include <glm/ext.hpp>
@@ -95,6 +98,28 @@ std::string get_cpu_brand()
     return brand;
 }
 
+size_t get_peak_memory_usage()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    // ru_maxrss is reported in kilobytes on Linux
+    return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
 float srgb_to_linear(float x)
 {
     if (x <= 0.04045f) {
@@ -16,6 +16,9 @@ std::string get_file_extension(const std::string &fname);
 
 std::string get_cpu_brand();
 
+// Get the peak resident memory usage of the process so far, in bytes
+size_t get_peak_memory_usage();
+
 float srgb_to_linear(const float x);
 
 float linear_to_srgb(const float x);